@@ -55,6 +55,7 @@ static void usage(void)
 	     "\n"
 	     "Commands for managing filesystem data:\n"
 	     "  data rereplicate     Rereplicate degraded data\n"
+	     "  data recompress      Rewrite data with the background compression type\n"
 	     "\n"
 	     "Encryption:\n"
 	     "  unlock               Unlock an encrypted filesystem prior to running/mounting\n"
@@ -129,6 +130,8 @@ static int data_cmds(int argc, char *argv[])
 
 	if (!strcmp(cmd, "rereplicate"))
 		return cmd_data_rereplicate(argc, argv);
+	if (!strcmp(cmd, "recompress"))
+		return cmd_data_recompress(argc, argv);
 
 	usage();
 	return 0;
@@ -46,3 +46,42 @@ int cmd_data_rereplicate(int argc, char *argv[])
 		.end	= POS_MAX,
 	});
 }
+
+static void data_recompress_usage(void)
+{
+	puts("bcachefs data recompress\n"
+	     "Usage: bcachefs data recompress filesystem\n"
+	     "\n"
+	     "Walks existing data in a filesystem, rewriting any data not\n"
+	     "compressed with the background_compression type\n"
+	     "\n"
+	     "Options:\n"
+	     "  -h, --help                  display this help and exit\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+	exit(EXIT_SUCCESS);
+}
+
+int cmd_data_recompress(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "h")) != -1)
+		switch (opt) {
+		case 'h':
+			data_recompress_usage();
+		}
+	args_shift(optind);
+
+	char *fs_path = arg_pop();
+	if (!fs_path)
+		die("Please supply a filesystem");
+
+	if (argc)
+		die("too many arguments");
+
+	return bchu_data(bcache_fs_open(fs_path), (struct bch_ioctl_data) {
+		.op	= BCH_DATA_OP_RECOMPRESS,
+		.start	= POS_MIN,
+		.end	= POS_MAX,
+	});
+}
@@ -36,7 +36,9 @@ x('b',	block_size,		"size",			NULL)			\
 x(0,	btree_node_size,	"size",			"Default 256k")		\
 x(0,	metadata_checksum_type,	"(none|crc32c|crc64)",	NULL)			\
 x(0,	data_checksum_type,	"(none|crc32c|crc64)",	NULL)			\
-x(0,	compression_type,	"(none|lz4|gzip)",	NULL)			\
+x(0,	compression_type,	"(none|lz4|gzip|zstd)",	NULL)			\
+x(0,	compression_level,	"#",			"gzip/zstd level, 0 for the default")\
+x(0,	background_compression_type, "(none|lz4|gzip|zstd)", NULL)		\
 x(0,	replicas,		"#",			NULL)			\
 x(0,	data_replicas,		"#",			NULL)			\
 x(0,	metadata_replicas,	"#",			NULL)			\
@@ -75,7 +77,10 @@ static void usage(void)
 	     "      --btree_node=size       Btree node size, default 256k\n"
 	     "      --metadata_checksum_type=(none|crc32c|crc64)\n"
 	     "      --data_checksum_type=(none|crc32c|crc64)\n"
-	     "      --compression_type=(none|lz4|gzip)\n"
+	     "      --compression_type=(none|lz4|gzip|zstd)\n"
+	     "      --compression_level=#   gzip/zstd level, 0 for the default\n"
+	     "      --background_compression_type=(none|lz4|gzip|zstd)\n"
+	     "                              Recompress data when it is moved off the fastest tier\n"
 	     "      --data_replicas=#       Number of data replicas\n"
 	     "      --metadata_replicas=#   Number of metadata replicas\n"
 	     "      --replicas=#            Sets both data and metadata replicas\n"
@@ -175,6 +180,17 @@ int cmd_format(int argc, char *argv[])
 						bch2_compression_types,
 						"compression type");
 			break;
+		case O_compression_level:
+			if (kstrtouint(optarg, 10, &opts.compression_level) ||
+			    opts.compression_level > 22)
+				die("invalid compression level");
+			break;
+		case O_background_compression_type:
+			opts.background_compression_type =
+				read_string_list_or_die(optarg,
+						bch2_compression_types,
+						"compression type");
+			break;
 		case O_data_replicas:
 			if (kstrtouint(optarg, 10, &opts.data_replicas) ||
 			    opts.data_replicas >= BCH_REPLICAS_MAX)
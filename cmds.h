@@ -28,6 +28,7 @@ int cmd_device_set_state(int argc, char *argv[]);
 int cmd_device_resize(int argc, char *argv[]);
 
 int cmd_data_rereplicate(int argc, char *argv[]);
+int cmd_data_recompress(int argc, char *argv[]);
 
 int cmd_unlock(int argc, char *argv[]);
 int cmd_set_passphrase(int argc, char *argv[]);
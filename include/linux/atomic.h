@@ -171,6 +171,8 @@ static inline long atomic_long_cmpxchg(atomic_long_t *v, long old, long new)
 	return cmpxchg(&v->counter, old, new);
 }
 
+#define atomic_long_xchg(v, i)		(xchg(&(v)->counter, (i)))
+
 static inline bool atomic_long_inc_not_zero(atomic_long_t *i)
 {
 	long old, v = atomic_long_read(i);
@@ -184,6 +186,7 @@ static inline bool atomic_long_inc_not_zero(atomic_long_t *i)
 }
 
 #define atomic_long_sub_and_test(i, v)	(atomic_long_sub_return((i), (v)) == 0)
+#define atomic_long_inc_return(v)	atomic_long_add_return(1, (v))
 
 typedef struct {
 	u64		counter;
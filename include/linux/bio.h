@@ -199,25 +199,21 @@ static inline struct bio *bio_next_split(struct bio *bio, int sectors,
 }
 
 struct bio_set {
-	unsigned int front_pad;
+	struct kmem_cache	*bio_slab;
+	unsigned int		front_pad;
+
+	mempool_t		bio_pool;
 };
 
-static inline void bioset_exit(struct bio_set *bs) {}
+extern void bioset_exit(struct bio_set *);
+extern int bioset_init(struct bio_set *, unsigned, unsigned, int);
 
 static inline void bioset_free(struct bio_set *bs)
 {
+	bioset_exit(bs);
 	kfree(bs);
 }
 
-static inline int bioset_init(struct bio_set *bs,
-			      unsigned pool_size,
-			      unsigned front_pad,
-			      int flags)
-{
-	bs->front_pad = front_pad;
-	return 0;
-}
-
 extern struct bio_set *bioset_create(unsigned int, unsigned int);
 extern struct bio_set *bioset_create_nobvec(unsigned int, unsigned int);
 enum {
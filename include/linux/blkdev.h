@@ -9,6 +9,8 @@
 typedef unsigned fmode_t;
 
 struct bio;
+struct blkdev_ioctx;
+struct task_struct;
 struct user_namespace;
 
 #define MINORBITS	20
@@ -82,6 +84,7 @@ struct block_device {
 	struct gendisk		__bd_disk;
 	int			bd_fd;
 	int			bd_sync_fd;
+	struct blkdev_ioctx	*bd_ioctx;
 
 	struct backing_dev_info	*bd_bdi;
 	struct backing_dev_info	__bd_bdi;
@@ -90,6 +93,22 @@ struct block_device {
 void generic_make_request(struct bio *);
 int submit_bio_wait(struct bio *);
 
+/*
+ * While plugged, bios are held back; at blk_finish_plug() (or when the task
+ * sleeps) they're sorted, contiguous bios are merged, and the resulting
+ * requests are submitted in one batch:
+ */
+#define BLK_MAX_REQUEST_COUNT	32
+
+struct blk_plug {
+	unsigned		nr_bios;
+	struct bio		*bios[BLK_MAX_REQUEST_COUNT];
+};
+
+void blk_start_plug(struct blk_plug *);
+void blk_finish_plug(struct blk_plug *);
+void blk_schedule_flush_plug(struct task_struct *);
+
 static inline void submit_bio(struct bio *bio)
 {
 	generic_make_request(bio);
@@ -1,12 +1,14 @@
 #ifndef __LINUX_CPUMASK_H
 #define __LINUX_CPUMASK_H
 
-#define num_online_cpus()	1U
-#define num_possible_cpus()	1U
+extern unsigned nr_cpu_ids;
+
+#define num_online_cpus()	nr_cpu_ids
+#define num_possible_cpus()	nr_cpu_ids
 #define num_present_cpus()	1U
 #define num_active_cpus()	1U
-#define cpu_online(cpu)		((cpu) == 0)
-#define cpu_possible(cpu)	((cpu) == 0)
+#define cpu_online(cpu)		((cpu) < nr_cpu_ids)
+#define cpu_possible(cpu)	((cpu) < nr_cpu_ids)
 #define cpu_present(cpu)	((cpu) == 0)
 #define cpu_active(cpu)		((cpu) == 0)
 
@@ -17,8 +19,9 @@
 #define for_each_cpu_and(cpu, mask, and)	\
 	for ((cpu) = 0; (cpu) < 1; (cpu)++, (void)mask, (void)and)
 
-#define for_each_possible_cpu(cpu) for_each_cpu((cpu), 1)
-#define for_each_online_cpu(cpu)   for_each_cpu((cpu), 1)
+#define for_each_possible_cpu(cpu)		\
+	for ((cpu) = 0; (cpu) < nr_cpu_ids; (cpu)++)
+#define for_each_online_cpu(cpu)   for_each_possible_cpu(cpu)
 #define for_each_present_cpu(cpu)  for_each_cpu((cpu), 1)
 
 #endif /* __LINUX_CPUMASK_H */
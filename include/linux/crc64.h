@@ -0,0 +1,6 @@
+#ifndef _LINUX_CRC64_H
+#define _LINUX_CRC64_H
+
+#include "tools-util.h"
+
+#endif	/* _LINUX_CRC64_H */
@@ -1 +1,11 @@
+#ifndef __TOOLS_LINUX_GFP_H
+#define __TOOLS_LINUX_GFP_H
+
 #include <linux/slab.h>
+
+static inline bool gfpflags_allow_blocking(const gfp_t gfp_flags)
+{
+	return !!(gfp_flags & __GFP_DIRECT_RECLAIM);
+}
+
+#endif /* __TOOLS_LINUX_GFP_H */
@@ -108,8 +108,14 @@
 
 #define NR_CPUS			32
 
-#define cpu_relax()		do {} while (0)
-#define cpu_relax_lowlatency()	do {} while (0)
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax()		__builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()		asm volatile("yield" ::: "memory")
+#else
+#define cpu_relax()		barrier()
+#endif
+#define cpu_relax_lowlatency()	cpu_relax()
 
 __printf(1, 2)
 static inline void panic(const char *fmt, ...)
@@ -7,81 +7,111 @@
 #include <linux/compiler.h>
 #include <linux/bug.h>
 #include <linux/slab.h>
+#include <linux/wait.h>
 
 struct kmem_cache;
 
 typedef void * (mempool_alloc_t)(gfp_t gfp_mask, void *pool_data);
 typedef void (mempool_free_t)(void *element, void *pool_data);
 
+/*
+ * The reserve is a fixed array of min_nr slots, threaded onto two lock free
+ * stacks - slots holding an element, and empty slots. Stack heads are a slot
+ * index (+1, 0 for empty) in the low 32 bits and a generation number in the
+ * high 32 bits, to avoid ABA:
+ */
+struct mempool_slot {
+	void			*element;
+	u32			next;
+};
+
 typedef struct mempool_s {
-	size_t			elem_size;
+	int			min_nr;
+	struct mempool_slot	*elements;
+	u64			full;
+	u64			empty;
+
 	void			*pool_data;
 	mempool_alloc_t		*alloc;
 	mempool_free_t		*free;
+	wait_queue_head_t	wait;
 } mempool_t;
 
 static inline bool mempool_initialized(mempool_t *pool)
 {
-	return true;
+	return pool->elements != NULL;
 }
 
+extern int mempool_init(mempool_t *pool, int min_nr,
+			mempool_alloc_t *alloc_fn, mempool_free_t *free_fn,
+			void *pool_data);
+extern mempool_t *mempool_create(int min_nr, mempool_alloc_t *alloc_fn,
+				 mempool_free_t *free_fn, void *pool_data);
 extern int mempool_resize(mempool_t *pool, int new_min_nr);
+extern void mempool_exit(mempool_t *pool);
+extern void mempool_destroy(mempool_t *pool);
 
-static inline void mempool_free(void *element, mempool_t *pool)
-{
-	free(element);
-}
-
-static inline void *mempool_alloc(mempool_t *pool, gfp_t gfp_mask) __malloc
-{
-	BUG_ON(!pool->elem_size);
-	return kmalloc(pool->elem_size, gfp_mask);
-}
-
-static inline void mempool_exit(mempool_t *pool) {}
+extern void *mempool_alloc(mempool_t *pool, gfp_t gfp_mask) __malloc;
+extern void mempool_free(void *element, mempool_t *pool);
 
-static inline void mempool_destroy(mempool_t *pool)
-{
-	free(pool);
-}
+/*
+ * A mempool_alloc_t and mempool_free_t that get the memory from
+ * a slab cache that is passed in through pool_data.
+ * Note: the slab cache may not have a ctor function.
+ */
+void *mempool_alloc_slab(gfp_t gfp_mask, void *pool_data);
+void mempool_free_slab(void *element, void *pool_data);
 
 static inline int
 mempool_init_slab_pool(mempool_t *pool, int min_nr, struct kmem_cache *kc)
 {
-	pool->elem_size = 0;
-	return 0;
+	return mempool_init(pool, min_nr, mempool_alloc_slab,
+			    mempool_free_slab, (void *) kc);
 }
 
 static inline mempool_t *
 mempool_create_slab_pool(int min_nr, struct kmem_cache *kc)
 {
-	mempool_t *pool = malloc(sizeof(*pool));
-	pool->elem_size = 0;
-	return pool;
+	return mempool_create(min_nr, mempool_alloc_slab, mempool_free_slab,
+			      (void *) kc);
 }
 
+/*
+ * a mempool_alloc_t and a mempool_free_t to kmalloc and kfree the
+ * amount of memory specified by pool_data
+ */
+void *mempool_kmalloc(gfp_t gfp_mask, void *pool_data);
+void mempool_kfree(void *element, void *pool_data);
+
 static inline int mempool_init_kmalloc_pool(mempool_t *pool, int min_nr, size_t size)
 {
-	pool->elem_size = size;
-	return 0;
+	return mempool_init(pool, min_nr, mempool_kmalloc,
+			    mempool_kfree, (void *) size);
 }
 
+static inline mempool_t *mempool_create_kmalloc_pool(int min_nr, size_t size)
+{
+	return mempool_create(min_nr, mempool_kmalloc, mempool_kfree,
+			      (void *) size);
+}
+
+/*
+ * A mempool_alloc_t and mempool_free_t for a simple page allocator that
+ * allocates pages of the order specified by pool_data
+ */
+void *mempool_alloc_pages(gfp_t gfp_mask, void *pool_data);
+void mempool_free_pages(void *element, void *pool_data);
+
 static inline int mempool_init_page_pool(mempool_t *pool, int min_nr, int order)
 {
-	pool->elem_size = PAGE_SIZE << order;
-	return 0;
+	return mempool_init(pool, min_nr, mempool_alloc_pages,
+			    mempool_free_pages, (void *)(long)order);
 }
 
-static inline int mempool_init(mempool_t *pool, int min_nr,
-			       mempool_alloc_t *alloc_fn,
-			       mempool_free_t *free_fn,
-			       void *pool_data)
+static inline mempool_t *mempool_create_page_pool(int min_nr, int order)
 {
-	pool->elem_size = (size_t) pool_data;
-	pool->pool_data	= pool_data;
-	pool->alloc	= alloc_fn;
-	pool->free	= free_fn;
-	return 0;
+	return mempool_create(min_nr, mempool_alloc_pages, mempool_free_pages,
+			      (void *)(long)order);
 }
 
 #endif /* _LINUX_MEMPOOL_H */
@@ -1,12 +1,40 @@
 #ifndef __TOOLS_LINUX_PERCPU_H
 #define __TOOLS_LINUX_PERCPU_H
 
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/types.h>
+
 #define __percpu
 
-#define free_percpu(percpu)				free(percpu)
+/*
+ * Each cpu gets a unit of PCPU_UNIT_SIZE bytes of address space, and a percpu
+ * pointer points to cpu 0's copy: cpu n's copy is at a fixed offset from it,
+ * so per_cpu_ptr() works on pointers to members, as in the kernel.
+ *
+ * We can't pin threads to cpus, so "cpus" are really slots that threads are
+ * assigned to round robin the first time they touch percpu data; a thread
+ * keeps its slot, so lg_local_lock() and this_cpu_ptr() agree.
+ */
+#define PCPU_UNIT_SIZE		(1UL << 20)
+
+extern __thread int __pcpu_cpu;
+int __pcpu_cpu_assign(void);
+
+static inline int raw_smp_processor_id(void)
+{
+	int cpu = __pcpu_cpu;
+
+	return likely(cpu >= 0) ? cpu : __pcpu_cpu_assign();
+}
 
-#define __alloc_percpu_gfp(size, align, gfp)		calloc(1, size)
-#define __alloc_percpu(size, align)			calloc(1, size)
+#define smp_processor_id()	raw_smp_processor_id()
+
+void __percpu *__alloc_percpu_gfp(size_t, size_t, gfp_t);
+void free_percpu(void __percpu *);
+
+#define __alloc_percpu(size, align)					\
+	__alloc_percpu_gfp(size, align, GFP_KERNEL)
 
 #define alloc_percpu_gfp(type, gfp)					\
 	(typeof(type) __percpu *)__alloc_percpu_gfp(sizeof(type),	\
@@ -17,8 +45,9 @@
 
 #define __verify_pcpu_ptr(ptr)
 
-#define per_cpu_ptr(ptr, cpu)	(ptr)
-#define raw_cpu_ptr(ptr)	(ptr)
+#define per_cpu_ptr(ptr, cpu)						\
+	((typeof(ptr)) ((void *) (ptr) + (size_t) (cpu) * PCPU_UNIT_SIZE))
+#define raw_cpu_ptr(ptr)	per_cpu_ptr(ptr, raw_smp_processor_id())
 #define this_cpu_ptr(ptr)	raw_cpu_ptr(ptr)
 
 #define __pcpu_size_call_return(stem, variable)				\
@@ -161,21 +190,24 @@ do {									\
 #define __this_cpu_inc_return(pcp)	__this_cpu_add_return(pcp, 1)
 #define __this_cpu_dec_return(pcp)	__this_cpu_add_return(pcp, -1)
 
-#define this_cpu_read(pcp)		((pcp))
-#define this_cpu_write(pcp, val)	((pcp) = val)
-#define this_cpu_add(pcp, val)		((pcp) += val)
-#define this_cpu_and(pcp, val)		((pcp) &= val)
-#define this_cpu_or(pcp, val)		((pcp) |= val)
-#define this_cpu_add_return(pcp, val)	((pcp) += val)
+/*
+ * Slots can be shared by multiple threads, so unlike the kernel these have to
+ * be atomic - but the cacheline is normally only touched by one thread:
+ */
+#define this_cpu_read(pcp)		READ_ONCE(*this_cpu_ptr(&(pcp)))
+#define this_cpu_write(pcp, val)	WRITE_ONCE(*this_cpu_ptr(&(pcp)), val)
+#define this_cpu_add(pcp, val)		((void) this_cpu_add_return(pcp, val))
+#define this_cpu_and(pcp, val)						\
+	((void) __atomic_and_fetch(this_cpu_ptr(&(pcp)), val, __ATOMIC_RELAXED))
+#define this_cpu_or(pcp, val)						\
+	((void) __atomic_or_fetch(this_cpu_ptr(&(pcp)), val, __ATOMIC_RELAXED))
+#define this_cpu_add_return(pcp, val)					\
+	__atomic_add_fetch(this_cpu_ptr(&(pcp)), val, __ATOMIC_RELAXED)
 #define this_cpu_xchg(pcp, nval)					\
-({									\
-	typeof(pcp) _r = (pcp);						\
-	(pcp) = (nval);							\
-	_r;								\
-})
+	__atomic_exchange_n(this_cpu_ptr(&(pcp)), nval, __ATOMIC_RELAXED)
 
-#define this_cpu_cmpxchg(pcp, oval, nval) \
-	__pcpu_size_call_return2(this_cpu_cmpxchg_, pcp, oval, nval)
+#define this_cpu_cmpxchg(pcp, oval, nval)				\
+	cmpxchg(this_cpu_ptr(&(pcp)), oval, nval)
 #define this_cpu_cmpxchg_double(pcp1, pcp2, oval1, oval2, nval1, nval2) \
 	__pcpu_double_call_return_bool(this_cpu_cmpxchg_double_, pcp1, pcp2, oval1, oval2, nval1, nval2)
 
@@ -1,7 +1,7 @@
 #ifndef _LINUX_PREFETCH_H
 #define _LINUX_PREFETCH_H
 
-#define prefetch(p)	\
-	({ __maybe_unused typeof(p) __var = (p); })
+#define prefetch(p)	__builtin_prefetch(p)
+#define prefetchw(p)	__builtin_prefetch(p, 1)
 
 #endif /* _LINUX_PREFETCH_H */
@@ -1,6 +1,11 @@
 #ifndef __TOOLS_LINUX_SHRINKER_H
 #define __TOOLS_LINUX_SHRINKER_H
 
+#include <linux/atomic.h>
+#include <linux/compiler.h>
+#include <linux/list.h>
+#include <linux/types.h>
+
 struct shrink_control {
 	gfp_t gfp_mask;
 	unsigned long nr_to_scan;
@@ -22,6 +27,18 @@ struct shrinker {
 int register_shrinker(struct shrinker *);
 void unregister_shrinker(struct shrinker *);
 
-void run_shrinkers(void);
+/*
+ * Bytes the memory monitor thread wants reclaimed; the allocation paths only
+ * check this, and reclaim when it's set:
+ */
+extern atomic_long_t shrinker_want;
+
+void __run_shrinkers(void);
+
+static inline void run_shrinkers(void)
+{
+	if (unlikely(atomic_long_read(&shrinker_want) > 0))
+		__run_shrinkers();
+}
 
 #endif /* __TOOLS_LINUX_SHRINKER_H */
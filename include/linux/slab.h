@@ -112,4 +112,26 @@ static inline void *vmap(struct page **pages, unsigned int count,
 
 #define vmalloc_to_page(addr)		((struct page *) (addr))
 
+/* kmem_cache: */
+
+#define SLAB_HWCACHE_ALIGN	0x00002000UL
+#define SLAB_PANIC		0x00040000UL
+#define SLAB_RECLAIM_ACCOUNT	0x00020000UL
+#define SLAB_ACCOUNT		0x04000000UL
+
+struct kmem_cache *kmem_cache_create(const char *, size_t, size_t,
+				     unsigned long, void (*)(void *));
+void kmem_cache_destroy(struct kmem_cache *);
+void *kmem_cache_alloc(struct kmem_cache *, gfp_t);
+void kmem_cache_free(struct kmem_cache *, void *);
+
+#define KMEM_CACHE(__struct, __flags)					\
+	kmem_cache_create(#__struct, sizeof(struct __struct),		\
+			  __alignof__(struct __struct), (__flags), NULL)
+
+static inline void *kmem_cache_zalloc(struct kmem_cache *k, gfp_t flags)
+{
+	return kmem_cache_alloc(k, flags | __GFP_ZERO);
+}
+
 #endif /* __TOOLS_LINUX_SLAB_H */
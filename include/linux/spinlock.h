@@ -3,26 +3,67 @@
 
 #include <linux/atomic.h>
 
+/*
+ * count is 0 when unlocked, 1 when locked, and 2 when locked and there may be
+ * waiters sleeping on the futex. Contended lockers spin with exponential
+ * backoff for a bit, then sleep: the lock holder may have been preempted.
+ */
 typedef struct {
 	int		count;
 } raw_spinlock_t;
 
 #define __RAW_SPIN_LOCK_UNLOCKED(name)	(raw_spinlock_t) { .count = 0 }
 
+/*
+ * With CONFIG_LOCK_STAT, each raw_spin_lock() call site counts acquisitions,
+ * contended acquisitions and sleeps; sites that saw contention are printed
+ * on exit:
+ */
+struct spin_lock_site {
+	const char		*file;
+	unsigned		line;
+	int			registered;
+	u64			acquired;
+	u64			contended;
+	u64			slept;
+	struct spin_lock_site	*next;
+};
+
+void __raw_spin_lock_slowpath(raw_spinlock_t *, struct spin_lock_site *);
+void __raw_spin_unlock_wake(raw_spinlock_t *);
+
 static inline void raw_spin_lock_init(raw_spinlock_t *lock)
 {
 	smp_store_release(&lock->count, 0);
 }
 
-static inline void raw_spin_lock(raw_spinlock_t *lock)
+static inline void __raw_spin_lock(raw_spinlock_t *lock,
+				   struct spin_lock_site *site)
 {
-	while (xchg_acquire(&lock->count, 1))
-		;
+	if (site)
+		__atomic_add_fetch(&site->acquired, 1, __ATOMIC_RELAXED);
+
+	if (unlikely(cmpxchg_acquire(&lock->count, 0, 1)))
+		__raw_spin_lock_slowpath(lock, site);
 }
 
+#ifdef CONFIG_LOCK_STAT
+#define raw_spin_lock(lock)						\
+do {									\
+	static struct spin_lock_site __site = {				\
+		.file = __FILE__, .line = __LINE__			\
+	};								\
+	__raw_spin_lock(lock, &__site);					\
+} while (0)
+#else
+#define raw_spin_lock(lock)		__raw_spin_lock(lock, NULL)
+#endif
+
 static inline void raw_spin_unlock(raw_spinlock_t *lock)
 {
-	smp_store_release(&lock->count, 0);
+	if (unlikely(__atomic_exchange_n(&lock->count, 0,
+					 __ATOMIC_RELEASE) == 2))
+		__raw_spin_unlock_wake(lock);
 }
 
 #define raw_spin_lock_irq(lock)		raw_spin_lock(lock)
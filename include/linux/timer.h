@@ -9,6 +9,7 @@ struct timer_list {
 	void			(*function)(unsigned long);
 	unsigned long		data;
 	bool			pending;
+	size_t			idx;	/* in pending timers heap */
 };
 
 static inline void init_timer(struct timer_list *timer)
@@ -6,6 +6,7 @@
 
 struct task_struct;
 struct workqueue_struct;
+struct work_list;
 struct work_struct;
 typedef void (*work_func_t)(struct work_struct *work);
 void delayed_work_timer_fn(unsigned long __data);
@@ -26,6 +27,10 @@ struct work_struct {
 	atomic_long_t data;
 	struct list_head entry;
 	work_func_t func;
+
+	/* private to linux/workqueue.c: */
+	struct workqueue_struct *wq;
+	struct work_list *list;
 };
 
 #define INIT_WORK(_work, _func)					\
@@ -33,8 +38,13 @@ do {								\
 	(_work)->data.counter = 0;				\
 	INIT_LIST_HEAD(&(_work)->entry);			\
 	(_work)->func = (_func);				\
+	(_work)->wq = NULL;					\
+	(_work)->list = NULL;					\
 } while (0)
 
+#define INIT_WORK_ONSTACK(_work, _func)	INIT_WORK(_work, _func)
+static inline void destroy_work_on_stack(struct work_struct *work) {}
+
 struct delayed_work {
 	struct work_struct work;
 	struct timer_list timer;
@@ -0,0 +1,18 @@
+#ifndef __TOOLS_LINUX_ZSTD_H
+#define __TOOLS_LINUX_ZSTD_H
+
+#define ZSTD_STATIC_LINKING_ONLY
+#include <zstd.h>
+
+/* kernel zstd API, implemented with libzstd's static context interface: */
+
+#define ZSTD_initDCtx(w, s)		ZSTD_initStaticDCtx(w, s)
+#define ZSTD_initCCtx(w, s)		ZSTD_initStaticCCtx(w, s)
+
+#define ZSTD_compressCCtx(w, dst, d_len, src, src_len, params)		\
+	ZSTD_compress_advanced(w, dst, d_len, src, src_len, NULL, 0, params)
+
+#define ZSTD_CCtxWorkspaceBound(p)	ZSTD_estimateCCtxSize_usingCParams(p)
+#define ZSTD_DCtxWorkspaceBound()	ZSTD_estimateDCtxSize()
+
+#endif /* __TOOLS_LINUX_ZSTD_H */
@@ -181,6 +181,9 @@ struct bch_sb *bch2_format(struct format_opts opts,
 	SET_BCH_SB_META_CSUM_TYPE(sb,		opts.meta_csum_type);
 	SET_BCH_SB_DATA_CSUM_TYPE(sb,		opts.data_csum_type);
 	SET_BCH_SB_COMPRESSION_TYPE(sb,		opts.compression_type);
+	SET_BCH_SB_COMPRESSION_LEVEL(sb,	opts.compression_level);
+	SET_BCH_SB_BACKGROUND_COMPRESSION_TYPE(sb,
+						opts.background_compression_type);
 
 	SET_BCH_SB_BTREE_NODE_SIZE(sb,		opts.btree_node_size);
 	SET_BCH_SB_GC_RESERVE(sb,		8);
@@ -539,6 +542,8 @@ void bch2_sb_print(struct bch_sb *sb, bool print_layout,
 	       "Metadata checksum type:		%s (%llu)\n"
 	       "Data checksum type:		%s (%llu)\n"
 	       "Compression type:		%s (%llu)\n"
+	       "Compression level:		%llu\n"
+	       "Background compression type:	%s (%llu)\n"
 
 	       "String hash type:		%s (%llu)\n"
 	       "32 bit inodes:			%llu\n"
@@ -578,6 +583,12 @@ void bch2_sb_print(struct bch_sb *sb, bool print_layout,
 	       ? bch2_compression_types[BCH_SB_COMPRESSION_TYPE(sb)]
 	       : "unknown",
 	       BCH_SB_COMPRESSION_TYPE(sb),
+	       BCH_SB_COMPRESSION_LEVEL(sb),
+
+	       BCH_SB_BACKGROUND_COMPRESSION_TYPE(sb) < BCH_COMPRESSION_OPT_NR
+	       ? bch2_compression_types[BCH_SB_BACKGROUND_COMPRESSION_TYPE(sb)]
+	       : "unknown",
+	       BCH_SB_BACKGROUND_COMPRESSION_TYPE(sb),
 
 	       BCH_SB_STR_HASH_TYPE(sb) < BCH_STR_HASH_NR
 	       ? bch2_str_hash_types[BCH_SB_STR_HASH_TYPE(sb)]
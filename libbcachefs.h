@@ -28,6 +28,8 @@ struct format_opts {
 	unsigned	meta_csum_type;
 	unsigned	data_csum_type;
 	unsigned	compression_type;
+	unsigned	compression_level;
+	unsigned	background_compression_type;
 
 	bool		encrypted;
 	char		*passphrase;
@@ -733,20 +733,20 @@ static void find_reclaimable_buckets_lru(struct bch_fs *c, struct bch_dev *ca)
 			.key	= bucket_sort_key(c, ca, b, m)
 		};
 
-		heap_add_or_replace(&ca->alloc_heap, e, -bucket_alloc_cmp);
+		heap_add_or_replace(&ca->alloc_heap, e, -bucket_alloc_cmp, NULL);
 	}
 
 	up_read(&ca->bucket_lock);
 	mutex_unlock(&c->prio_clock[READ].lock);
 
-	heap_resort(&ca->alloc_heap, bucket_alloc_cmp);
+	heap_resort(&ca->alloc_heap, bucket_alloc_cmp, NULL);
 
 	/*
 	 * If we run out of buckets to invalidate, bch2_allocator_thread() will
 	 * kick stuff and retry us
 	 */
 	while (!fifo_full(&ca->free_inc) &&
-	       heap_pop(&ca->alloc_heap, e, bucket_alloc_cmp))
+	       heap_pop(&ca->alloc_heap, e, bucket_alloc_cmp, NULL))
 		bch2_invalidate_one_bucket(c, ca, e.bucket);
 }
 
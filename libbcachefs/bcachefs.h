@@ -194,6 +194,7 @@
 #include <linux/shrinker.h>
 #include <linux/types.h>
 #include <linux/workqueue.h>
+#include <linux/zstd.h>
 
 #include "bcachefs_format.h"
 #include "bset.h"
@@ -241,7 +242,10 @@ do {									\
 	BCH_DEBUG_PARAM(btree_gc_rewrite_disabled,			\
 		"Disables rewriting of btree nodes during mark and sweep")\
 	BCH_DEBUG_PARAM(btree_shrinker_disabled,			\
-		"Disables the shrinker callback for the btree node cache")
+		"Disables the shrinker callback for the btree node cache")\
+	BCH_DEBUG_PARAM(crypt_parallel_disabled,			\
+		"Disables splitting large checksum/encryption operations "\
+		"across worker threads")
 
 /* Parameters that should only be compiled in in debug mode: */
 #define BCH_DEBUG_PARAMS_DEBUG()					\
@@ -321,6 +325,11 @@ struct io_count {
 	u64			sectors[2][BCH_DATA_NR];
 };
 
+struct btree_insert_stats {
+	u64			appends;
+	u64			searches;
+};
+
 struct bch_dev {
 	struct kobject		kobj;
 	struct percpu_ref	ref;
@@ -646,14 +655,24 @@ struct bch_fs {
 	struct mutex		bio_bounce_pages_lock;
 	mempool_t		bio_bounce_pages;
 
-	mempool_t		lz4_workspace_pool;
-	void			*zlib_workspace;
-	struct mutex		zlib_workspace_lock;
+	ZSTD_parameters		zstd_params;
+	spinlock_t		compress_workspace_lock;
+	wait_queue_head_t	compress_workspace_wait;
+	void			**compress_workspaces;
+	size_t			compress_workspace_size;
+	unsigned		compress_workspaces_free;
+	unsigned		compress_workspaces_nr;
+	unsigned		compress_workspaces_max;
 	mempool_t		compression_bounce[2];
 
 	struct crypto_shash	*sha256;
 	struct crypto_skcipher	*chacha20;
 	struct crypto_shash	*poly1305;
+	/*
+	 * for splitting up large encrypt/checksum operations: callers may be
+	 * running on system_unbound_wq and wait on these, so they can't go there
+	 */
+	struct workqueue_struct	*crypt_wq;
 
 	atomic64_t		key_version;
 
@@ -707,12 +726,23 @@ struct bch_fs {
 	atomic_long_t		read_realloc_races;
 	atomic_long_t		extent_migrate_done;
 	atomic_long_t		extent_migrate_raced;
+	atomic_long_t		compress_skipped;
+	atomic_long_t		compress_skip_audits;
+	atomic_long_t		compress_skip_wrong;
+	atomic_long_t		compress_wasted;
+	atomic_long_t		compress_workspace_hits;
+	atomic_long_t		compress_workspace_misses;
+	atomic_long_t		compress_workspace_waits;
+	struct btree_insert_stats __percpu *btree_insert_stats;
 
 	unsigned		btree_gc_periodic:1;
 	unsigned		copy_gc_enabled:1;
 	unsigned		tiering_enabled:1;
 	unsigned		tiering_percent;
 
+	/* data recompress job, in sectors per second: */
+	struct bch_ratelimit	recompress_rate;
+
 #define BCH_DEBUG_PARAM(name, description) bool name;
 	BCH_DEBUG_PARAMS_ALL()
 #undef BCH_DEBUG_PARAM
@@ -369,7 +369,8 @@ enum bch_compression_type {
 	BCH_COMPRESSION_LZ4_OLD		= 1,
 	BCH_COMPRESSION_GZIP		= 2,
 	BCH_COMPRESSION_LZ4		= 3,
-	BCH_COMPRESSION_NR		= 4,
+	BCH_COMPRESSION_ZSTD		= 4,
+	BCH_COMPRESSION_NR		= 5,
 };
 
 enum bch_extent_entry_type {
@@ -607,12 +608,14 @@ BKEY_VAL_TYPE(inode_generation,	BCH_INODE_GENERATION);
 	BCH_INODE_FIELD(bi_dev,				32)	\
 	BCH_INODE_FIELD(bi_data_checksum,		8)	\
 	BCH_INODE_FIELD(bi_compression,			8)	\
-	BCH_INODE_FIELD(bi_project,			32)
+	BCH_INODE_FIELD(bi_project,			32)	\
+	BCH_INODE_FIELD(bi_checksum_granularity,	8)
 
 #define BCH_INODE_FIELDS_INHERIT()				\
 	BCH_INODE_FIELD(bi_data_checksum)			\
 	BCH_INODE_FIELD(bi_compression)				\
-	BCH_INODE_FIELD(bi_project)
+	BCH_INODE_FIELD(bi_project)				\
+	BCH_INODE_FIELD(bi_checksum_granularity)
 
 enum {
 	/*
@@ -1077,10 +1080,17 @@ LE64_BITMASK(BCH_SB_ENCODED_EXTENT_MAX_BITS,
 LE64_BITMASK(BCH_SB_META_REPLICAS_REQ,	struct bch_sb, flags[1], 20, 24);
 LE64_BITMASK(BCH_SB_DATA_REPLICAS_REQ,	struct bch_sb, flags[1], 24, 28);
 
+LE64_BITMASK(BCH_SB_COMPRESSION_LEVEL,	struct bch_sb, flags[1], 28, 33);
+LE64_BITMASK(BCH_SB_BACKGROUND_COMPRESSION_TYPE,
+					struct bch_sb, flags[1], 33, 37);
+LE64_BITMASK(BCH_SB_CHECKSUM_GRANULARITY,
+					struct bch_sb, flags[1], 37, 45);
+
 /* Features: */
 enum bch_sb_features {
 	BCH_FEATURE_LZ4			= 0,
 	BCH_FEATURE_GZIP		= 1,
+	BCH_FEATURE_ZSTD		= 2,
 };
 
 /* options: */
@@ -1112,7 +1122,8 @@ enum bch_compression_opts {
 	BCH_COMPRESSION_OPT_NONE	= 0,
 	BCH_COMPRESSION_OPT_LZ4		= 1,
 	BCH_COMPRESSION_OPT_GZIP	= 2,
-	BCH_COMPRESSION_OPT_NR		= 3,
+	BCH_COMPRESSION_OPT_ZSTD	= 3,
+	BCH_COMPRESSION_OPT_NR		= 4,
 };
 
 /*
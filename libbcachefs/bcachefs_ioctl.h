@@ -78,7 +78,8 @@ enum bch_data_ops {
 	BCH_DATA_OP_SCRUB	= 0,
 	BCH_DATA_OP_REREPLICATE	= 1,
 	BCH_DATA_OP_MIGRATE	= 2,
-	BCH_DATA_OP_NR		= 3,
+	BCH_DATA_OP_RECOMPRESS	= 3,
+	BCH_DATA_OP_NR		= 4,
 };
 
 struct bch_ioctl_data {
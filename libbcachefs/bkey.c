@@ -266,21 +266,53 @@ struct bkey __bch2_bkey_unpack_key(const struct bkey_format *format,
 }
 
 #ifndef HAVE_BCACHEFS_COMPILED_UNPACK
-struct bpos __bkey_unpack_pos(const struct bkey_format *format,
-				     const struct bkey_packed *in)
+int bch2_compile_bkey_format(const struct bkey_format *format, void *_out)
 {
-	struct unpack_state state = unpack_state_init(format, in);
-	struct bpos out;
+	struct bkey_unpack_table *t = _out;
+	unsigned key_bytes = format->key_u64s * sizeof(u64);
+	unsigned i, pos = high_bit_offset;
 
-	EBUG_ON(format->nr_fields != BKEY_NR_FIELDS);
-	EBUG_ON(in->u64s < format->key_u64s);
-	EBUG_ON(in->format != KEY_FORMAT_LOCAL_BTREE);
+	/* byte offsets are computed from the low end of the key: */
+#ifdef __LITTLE_ENDIAN
+#define key_byte(o)	(o)
+#else
+#define key_byte(o)	(key_bytes - sizeof(u64) - (o))
+#endif
 
-	out.inode	= get_inc_field(&state, BKEY_FIELD_INODE);
-	out.offset	= get_inc_field(&state, BKEY_FIELD_OFFSET);
-	out.snapshot	= get_inc_field(&state, BKEY_FIELD_SNAPSHOT);
+	for (i = 0; i < BKEY_NR_FIELDS; i++) {
+		struct bkey_unpack_field *f = &t->f[i];
+		unsigned bits = format->bits_per_field[i];
+		/* bit offset of the field's low bit: */
+		unsigned b = key_bytes * 8 - pos - bits;
 
-	return out;
+		memset(f, 0, sizeof(*f));
+		f->offset	= le64_to_cpu(format->field_offset[i]);
+		pos += bits;
+
+		if (!bits)
+			continue;
+
+		f->mask		= ~0ULL >> (64 - bits);
+
+		if (bits <= 57) {
+			/* fits in one unaligned load at any bit alignment: */
+			unsigned o = max_t(int, 0,
+					   DIV_ROUND_UP(b + bits, 8) - 8);
+
+			f->byte		= key_byte(o);
+			f->shift	= b - o * 8;
+		} else {
+			unsigned lo = b / 64, hi = (b + bits - 1) / 64;
+
+			f->byte		= key_byte(lo * 8);
+			f->hi_byte	= key_byte(hi * 8);
+			f->shift	= b % 64;
+			f->wide		= true;
+		}
+	}
+#undef key_byte
+
+	return sizeof(*t);
 }
 #endif
 
@@ -758,6 +790,8 @@ static inline int __bkey_cmp_bits(const u64 *l, const u64 *r,
 	return cmp;
 }
 
+#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
+
 #define I(_x)			(*(out)++ = (_x))
 #define I1(i0)						I(i0)
 #define I2(i0, i1)		(I1(i0),		I(i1))
@@ -987,6 +1021,8 @@ int bch2_compile_bkey_format(const struct bkey_format *format, void *_out)
 	return (void *) out - _out;
 }
 
+#endif /* HAVE_BCACHEFS_COMPILED_UNPACK */
+
 #else
 static inline int __bkey_cmp_bits(const u64 *l, const u64 *r,
 				  unsigned nr_key_bits)
@@ -2,12 +2,17 @@
 #define _BCACHEFS_BKEY_H
 
 #include <linux/bug.h>
+#include <asm/unaligned.h>
 #include "bcachefs_format.h"
 
 #include "util.h"
 #include "vstructs.h"
 
-#ifdef CONFIG_X86_64
+/*
+ * The x86-64 unpack JIT needs W+X memory; build with
+ * -DNO_BCACHEFS_COMPILED_UNPACK where that isn't allowed:
+ */
+#if defined(CONFIG_X86_64) && !defined(NO_BCACHEFS_COMPILED_UNPACK)
 #define HAVE_BCACHEFS_COMPILED_UNPACK	1
 #endif
 
@@ -348,11 +353,6 @@ bool bch2_bkey_transform(const struct bkey_format *,
 struct bkey __bch2_bkey_unpack_key(const struct bkey_format *,
 				   const struct bkey_packed *);
 
-#ifndef HAVE_BCACHEFS_COMPILED_UNPACK
-struct bpos __bkey_unpack_pos(const struct bkey_format *,
-			      const struct bkey_packed *);
-#endif
-
 bool bch2_bkey_pack_key(struct bkey_packed *, const struct bkey *,
 		   const struct bkey_format *);
 
@@ -385,17 +385,30 @@ static inline u64 bkey_field_max(const struct bkey_format *f,
 		: U64_MAX;
 }
 
-#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
-
-int bch2_compile_bkey_format(const struct bkey_format *, void *);
+#ifndef HAVE_BCACHEFS_COMPILED_UNPACK
 
-#else
+/*
+ * Without the JIT, a format is compiled to where each field lives in the
+ * packed key, so unpacking doesn't have to walk the fields in order: most
+ * fields are then a single unaligned load, shift and mask.
+ */
+struct bkey_unpack_field {
+	u64			offset;
+	u64			mask;	/* 0 if the field has no bits */
+	u8			byte;	/* of the u64 holding the field */
+	u8			shift;
+	u8			wide;	/* > 57 bits: may need two loads */
+	u8			hi_byte;
+};
 
-static inline int bch2_compile_bkey_format(const struct bkey_format *format,
-					  void *out) { return 0; }
+struct bkey_unpack_table {
+	struct bkey_unpack_field f[BKEY_NR_FIELDS];
+};
 
 #endif
 
+int bch2_compile_bkey_format(const struct bkey_format *, void *);
+
 static inline void bkey_reassemble(struct bkey_i *dst,
 				   struct bkey_s_c src)
 {
@@ -599,12 +612,14 @@ BKEY_VAL_ACCESSORS(quota,		BCH_QUOTA);
 #define high_bit_offset		0
 #define __high_word(u64s, k)	((k)->_data + (u64s) - 1)
 #define nth_word(p, n)		((p) - (n))
+#define get_unaligned_key64(p)	get_unaligned_le64(p)
 
 #else
 
 #define high_bit_offset		KEY_PACKED_BITS_START
 #define __high_word(u64s, k)	((k)->_data)
 #define nth_word(p, n)		((p) + (n))
+#define get_unaligned_key64(p)	get_unaligned_be64(p)
 
 #endif
 
@@ -612,6 +627,66 @@ BKEY_VAL_ACCESSORS(quota,		BCH_QUOTA);
 #define next_word(p)		nth_word(p, 1)
 #define prev_word(p)		nth_word(p, -1)
 
+#ifndef HAVE_BCACHEFS_COMPILED_UNPACK
+
+static __always_inline u64 bkey_unpack_field(const struct bkey_unpack_field *f,
+					     const struct bkey_packed *k)
+{
+	const u8 *p = (const u8 *) k->_data;
+	u64 v = get_unaligned_key64(p + f->byte) >> f->shift;
+
+	/* avoid shift by 64 if shift is 0: */
+	if (unlikely(f->wide))
+		v |= (get_unaligned_key64(p + f->hi_byte) << 1) << (63 - f->shift);
+
+	return (v & f->mask) + f->offset;
+}
+
+static __always_inline
+struct bkey bkey_unpack_key_table(const struct bkey_unpack_table *t,
+				  const struct bkey_format *format,
+				  const struct bkey_packed *in)
+{
+	struct bkey out;
+
+#ifdef __LITTLE_ENDIAN
+	/*
+	 * u64s, format, needs_whiteout, type and pad with a single store, as
+	 * the JIT does - byte stores here stall later loads of the whole key:
+	 */
+	*((u32 *) &out) = (*((const u32 *) in) & 0x00ffffff) +
+		((KEY_FORMAT_CURRENT << 8) | (BKEY_U64s - format->key_u64s));
+#else
+	out.u64s	= BKEY_U64s + in->u64s - format->key_u64s;
+	out.format	= KEY_FORMAT_CURRENT;
+	out.needs_whiteout = in->needs_whiteout;
+	out.type	= in->type;
+	out.pad[0]	= 0;
+#endif
+
+	out.p.inode	= bkey_unpack_field(&t->f[BKEY_FIELD_INODE], in);
+	out.p.offset	= bkey_unpack_field(&t->f[BKEY_FIELD_OFFSET], in);
+	out.p.snapshot	= bkey_unpack_field(&t->f[BKEY_FIELD_SNAPSHOT], in);
+	out.size	= bkey_unpack_field(&t->f[BKEY_FIELD_SIZE], in);
+	out.version.hi	= bkey_unpack_field(&t->f[BKEY_FIELD_VERSION_HI], in);
+	out.version.lo	= bkey_unpack_field(&t->f[BKEY_FIELD_VERSION_LO], in);
+
+	return out;
+}
+
+static __always_inline
+struct bpos bkey_unpack_pos_table(const struct bkey_unpack_table *t,
+				  const struct bkey_packed *in)
+{
+	return (struct bpos) {
+		.inode		= bkey_unpack_field(&t->f[BKEY_FIELD_INODE], in),
+		.offset		= bkey_unpack_field(&t->f[BKEY_FIELD_OFFSET], in),
+		.snapshot	= bkey_unpack_field(&t->f[BKEY_FIELD_SNAPSHOT], in),
+	};
+}
+
+#endif
+
 #ifdef CONFIG_BCACHEFS_DEBUG
 void bch2_bkey_pack_test(void);
 #else
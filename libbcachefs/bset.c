@@ -311,6 +311,39 @@ struct rw_aux_tree {
 	struct bpos	k;
 };
 
+/*
+ * The lookup table for the write set is split into small fixed size blocks, so
+ * that inserting a key only has to move entries within one block: the unused
+ * slots at the end of a block are copies of its last entry, so searches don't
+ * have to skip them.
+ *
+ * Offsets are stored relative to a per block shift, and the shift fields form a
+ * Fenwick tree - a block's shift is the sum of its own shift field and those of
+ * log(blocks) of the blocks before it - so adjusting the offsets of every block
+ * after an insert only touches log(blocks) blocks.
+ *
+ * If the aux area doesn't have room for a whole block, the table is a single
+ * block with fewer slots.
+ */
+#define RW_AUX_TREE_BLOCK_BITS	3
+#define RW_AUX_TREE_BLOCK	(1U << RW_AUX_TREE_BLOCK_BITS)
+#define RW_AUX_TREE_BLOCK_MASK	(RW_AUX_TREE_BLOCK - 1)
+
+struct rw_aux_block {
+	u16			shift;
+	u8			nr;
+	struct rw_aux_tree	d[RW_AUX_TREE_BLOCK];
+};
+
+static unsigned rw_aux_tree_bytes(unsigned size)
+{
+	return size < RW_AUX_TREE_BLOCK
+		? offsetof(struct rw_aux_block, d) +
+		  sizeof(struct rw_aux_tree) * size
+		: sizeof(struct rw_aux_block) *
+		  (size >> RW_AUX_TREE_BLOCK_BITS);
+}
+
 /*
  * BSET_CACHELINE was originally intended to match the hardware cacheline size -
  * it used to be 64, but I realized the lookup code would touch slightly less
@@ -362,7 +395,7 @@ static unsigned bset_aux_tree_buf_end(const struct bset_tree *t)
 				     sizeof(u8) * t->size, 8);
 	case BSET_RW_AUX_TREE:
 		return t->aux_data_offset +
-			DIV_ROUND_UP(sizeof(struct rw_aux_tree) * t->size, 8);
+			DIV_ROUND_UP(rw_aux_tree_bytes(t->size), 8);
 	default:
 		BUG();
 	}
@@ -441,8 +474,13 @@ void bch2_btree_keys_free(struct btree *b)
 int bch2_btree_keys_alloc(struct btree *b, unsigned page_order, gfp_t gfp)
 {
 	b->page_order	= page_order;
+#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
 	b->aux_data	= __vmalloc(btree_aux_data_bytes(b), gfp,
 				    PAGE_KERNEL_EXEC);
+#else
+	b->aux_data	= __vmalloc(btree_aux_data_bytes(b), gfp,
+				    PAGE_KERNEL);
+#endif
 	if (!b->aux_data)
 		return -ENOMEM;
 
@@ -547,14 +585,117 @@ static struct bkey_packed *tree_to_prev_bkey(const struct btree *b,
 	return (void *) (tree_to_bkey(b, t, j)->_data - prev_u64s);
 }
 
-static struct rw_aux_tree *rw_aux_tree(const struct btree *b,
-				       const struct bset_tree *t)
+static struct rw_aux_block *rw_aux_tree(const struct btree *b,
+					const struct bset_tree *t)
 {
 	EBUG_ON(bset_aux_tree_type(t) != BSET_RW_AUX_TREE);
 
 	return __aux_tree_base(b, t);
 }
 
+static unsigned rw_aux_tree_nr_blocks(const struct bset_tree *t)
+{
+	return DIV_ROUND_UP(t->size, RW_AUX_TREE_BLOCK);
+}
+
+/* Slots per block - fewer than RW_AUX_TREE_BLOCK only for a truncated block: */
+static unsigned rw_aux_block_slots(const struct bset_tree *t)
+{
+	return min_t(unsigned, t->size, RW_AUX_TREE_BLOCK);
+}
+
+static struct rw_aux_block *rw_aux_block(const struct btree *b,
+					 const struct bset_tree *t,
+					 unsigned j)
+{
+	return rw_aux_tree(b, t) + (j >> RW_AUX_TREE_BLOCK_BITS);
+}
+
+static struct rw_aux_tree *rw_aux_entry(const struct btree *b,
+					const struct bset_tree *t,
+					unsigned j)
+{
+	return &rw_aux_block(b, t, j)->d[j & RW_AUX_TREE_BLOCK_MASK];
+}
+
+/* Shift of block @m: */
+static u16 rw_aux_block_shift(const struct btree *b,
+			      const struct bset_tree *t,
+			      unsigned m)
+{
+	struct rw_aux_block *blk = rw_aux_tree(b, t);
+	u16 shift = 0;
+
+	for (m++; m; m &= m - 1)
+		shift += blk[m - 1].shift;
+	return shift;
+}
+
+/* Add @shift to the offsets in blocks @m and after: */
+static void rw_aux_blocks_shift(const struct btree *b,
+				const struct bset_tree *t,
+				unsigned m, int shift)
+{
+	struct rw_aux_block *blk = rw_aux_tree(b, t);
+	unsigned nr = rw_aux_tree_nr_blocks(t);
+
+	for (m++; m <= nr; m += m & -m)
+		blk[m - 1].shift += shift;
+}
+
+/* Set up the shift field of new last block @m, to the shift of @m - 1: */
+static void rw_aux_block_init_shift(const struct btree *b,
+				    const struct bset_tree *t,
+				    unsigned m)
+{
+	struct rw_aux_block *blk = rw_aux_tree(b, t);
+	unsigned first = (m + 1) & m;
+
+	EBUG_ON(m + 1 != rw_aux_tree_nr_blocks(t));
+
+	blk[m].shift = m ? rw_aux_block_shift(b, t, m - 1) : 0;
+	if (first)
+		blk[m].shift -= rw_aux_block_shift(b, t, first - 1);
+}
+
+/* Fold the shifts into the offsets, before moving blocks around: */
+static void rw_aux_tree_flatten(const struct btree *b,
+				const struct bset_tree *t)
+{
+	struct rw_aux_block *blk = rw_aux_tree(b, t);
+	unsigned m = rw_aux_tree_nr_blocks(t), i;
+
+	/* last block first - zeroing a shift field only affects later blocks */
+	while (m--) {
+		u16 shift = rw_aux_block_shift(b, t, m);
+
+		for (i = 0; i < rw_aux_block_slots(t); i++)
+			blk[m].d[i].offset += shift;
+		blk[m].shift = 0;
+	}
+}
+
+static unsigned rw_aux_offset(const struct btree *b,
+			      const struct bset_tree *t,
+			      unsigned j)
+{
+	return (u16) (rw_aux_entry(b, t, j)->offset +
+		      rw_aux_block_shift(b, t, j >> RW_AUX_TREE_BLOCK_BITS));
+}
+
+/* Entry @i of block @src, with its offset made relative to block @dst: */
+static struct rw_aux_tree rw_aux_entry_rebase(const struct btree *b,
+					      const struct bset_tree *t,
+					      unsigned dst, unsigned src,
+					      unsigned i)
+{
+	struct rw_aux_tree e = rw_aux_tree(b, t)[src].d[i];
+
+	e.offset += rw_aux_block_shift(b, t, src) -
+		rw_aux_block_shift(b, t, dst);
+	return e;
+}
+
 /*
  * For the write set - the one we're currently inserting keys into - we don't
  * maintain a full search tree, we just keep a simple lookup table in t->prev.
@@ -563,25 +704,81 @@ static struct bkey_packed *rw_aux_to_bkey(const struct btree *b,
 					  struct bset_tree *t,
 					  unsigned j)
 {
-	return __btree_node_offset_to_key(b, rw_aux_tree(b, t)[j].offset);
+	return __btree_node_offset_to_key(b, rw_aux_offset(b, t, j));
 }
 
-static void rw_aux_tree_set(const struct btree *b, struct bset_tree *t,
-			    unsigned j, struct bkey_packed *k)
+/* Skip over the unused slots at the end of a block: */
+static unsigned rw_aux_tree_normalize(const struct btree *b,
+				      const struct bset_tree *t,
+				      unsigned j)
+{
+	if ((j & RW_AUX_TREE_BLOCK_MASK) &&
+	    (j & RW_AUX_TREE_BLOCK_MASK) >= rw_aux_block(b, t, j)->nr)
+		j = min_t(unsigned, round_up(j, RW_AUX_TREE_BLOCK), t->size);
+	return j;
+}
+
+static unsigned rw_aux_tree_next(const struct btree *b,
+				 const struct bset_tree *t,
+				 unsigned j)
 {
+	return rw_aux_tree_normalize(b, t, j + 1);
+}
+
+static void rw_aux_block_fill(const struct bset_tree *t,
+			      struct rw_aux_block *blk)
+{
+	unsigned i;
+
+	for (i = blk->nr; i < rw_aux_block_slots(t); i++)
+		blk->d[i] = blk->d[blk->nr - 1];
+}
+
+static void __rw_aux_block_set(const struct btree *b, struct bset_tree *t,
+			       struct rw_aux_block *blk, unsigned i,
+			       struct bkey_packed *k)
+{
+	unsigned m = blk - rw_aux_tree(b, t);
+
 	EBUG_ON(k >= btree_bkey_last(b, t));
+	EBUG_ON(i >= blk->nr);
 
-	rw_aux_tree(b, t)[j] = (struct rw_aux_tree) {
-		.offset	= __btree_node_key_to_offset(b, k),
-		.k	= bkey_unpack_pos(b, k),
+	/*
+	 * The first entry's key is never compared against, but copies of it
+	 * may be - so it has to sort before everything else:
+	 */
+	blk->d[i] = (struct rw_aux_tree) {
+		.offset	= __btree_node_key_to_offset(b, k) -
+			rw_aux_block_shift(b, t, m),
+		.k	= !m && !i
+			? POS_MIN
+			: bkey_unpack_pos(b, k),
 	};
 }
 
+static void rw_aux_block_set(const struct btree *b, struct bset_tree *t,
+			     struct rw_aux_block *blk, unsigned i,
+			     struct bkey_packed *k)
+{
+	__rw_aux_block_set(b, t, blk, i, k);
+
+	if (i == blk->nr - 1)
+		rw_aux_block_fill(t, blk);
+}
+
+static void rw_aux_tree_set(const struct btree *b, struct bset_tree *t,
+			    unsigned j, struct bkey_packed *k)
+{
+	rw_aux_block_set(b, t, rw_aux_block(b, t, j),
+			 j & RW_AUX_TREE_BLOCK_MASK, k);
+}
+
 static void bch2_bset_verify_rw_aux_tree(struct btree *b,
 					struct bset_tree *t)
 {
 	struct bkey_packed *k = btree_bkey_first(b, t);
-	unsigned j = 0;
+	struct rw_aux_block *blk;
+	unsigned i, j = 0;
 
 	if (!btree_keys_expensive_checks(b))
 		return;
@@ -591,20 +788,33 @@ static void bch2_bset_verify_rw_aux_tree(struct btree *b,
 	if (!bset_has_rw_aux_tree(t))
 		return;
 
-	BUG_ON(t->size < 1);
+	BUG_ON(!t->size);
+	BUG_ON(t->size > RW_AUX_TREE_BLOCK &&
+	       (t->size & RW_AUX_TREE_BLOCK_MASK));
 	BUG_ON(rw_aux_to_bkey(b, t, j) != k);
+	BUG_ON(bkey_cmp(rw_aux_tree(b, t)->d[0].k, POS_MIN));
+
+	for (blk = rw_aux_tree(b, t);
+	     blk < rw_aux_tree(b, t) + rw_aux_tree_nr_blocks(t);
+	     blk++) {
+		BUG_ON(!blk->nr || blk->nr > rw_aux_block_slots(t));
+
+		for (i = blk->nr; i < rw_aux_block_slots(t); i++)
+			BUG_ON(blk->d[i].offset != blk->d[blk->nr - 1].offset ||
+			       bkey_cmp(blk->d[i].k, blk->d[blk->nr - 1].k));
+	}
 
 	goto start;
 	while (1) {
 		if (rw_aux_to_bkey(b, t, j) == k) {
-			BUG_ON(bkey_cmp(rw_aux_tree(b, t)[j].k,
+			BUG_ON(bkey_cmp(rw_aux_entry(b, t, j)->k,
 					bkey_unpack_pos(b, k)));
 start:
-			if (++j == t->size)
+			if ((j = rw_aux_tree_next(b, t, j)) == t->size)
 				break;
 
-			BUG_ON(rw_aux_tree(b, t)[j].offset <=
-			       rw_aux_tree(b, t)[j - 1].offset);
+			BUG_ON(rw_aux_offset(b, t, j) <=
+			       rw_aux_offset(b, t, j - 1));
 		}
 
 		k = bkey_next(k);
@@ -612,30 +822,63 @@ start:
 	}
 }
 
-/* returns idx of first entry >= offset: */
+/*
+ * returns idx of first entry >= offset - never one of the unused slots at the
+ * end of a block, since those compare equal to the entry before them:
+ */
 static unsigned rw_aux_tree_bsearch(struct btree *b,
 				    struct bset_tree *t,
 				    unsigned offset)
 {
-	unsigned l = 0, r = t->size;
+	struct rw_aux_block *blk = rw_aux_tree(b, t);
+	unsigned nr = rw_aux_tree_nr_blocks(t), n = 0, step, l, r;
+	u16 shift = 0;
 
 	EBUG_ON(bset_aux_tree_type(t) != BSET_RW_AUX_TREE);
 
+	/* Sequential inserts append - check the end first: */
+	if (rw_aux_offset(b, t, t->size - 1) < offset)
+		return t->size;
+
+	/*
+	 * First find the block: walking down the tree of shifts, each block we
+	 * compare against has its shift summed by the time we get to it:
+	 */
+	for (step = rounddown_pow_of_two(nr); step; step >>= 1) {
+		u16 s;
+
+		if (n + step > nr)
+			continue;
+
+		s = shift + blk[n + step - 1].shift;
+		if ((u16) (blk[n + step - 1].d[0].offset + s) < offset) {
+			n += step;
+			shift = s;
+		}
+	}
+
+	/* n is now the number of blocks that start before @offset: */
+	if (!n)
+		return 0;
+
+	blk += n - 1;
+	l = (n - 1) << RW_AUX_TREE_BLOCK_BITS;
+	r = l + rw_aux_block_slots(t);
+
 	while (l < r) {
 		unsigned m = (l + r) >> 1;
 
-		if (rw_aux_tree(b, t)[m].offset < offset)
+		if ((u16) (blk->d[m & RW_AUX_TREE_BLOCK_MASK].offset + shift) < offset)
 			l = m + 1;
 		else
 			r = m;
 	}
 
 	EBUG_ON(l < t->size &&
-		rw_aux_tree(b, t)[l].offset < offset);
+		rw_aux_offset(b, t, l) < offset);
 	EBUG_ON(l &&
-		rw_aux_tree(b, t)[l - 1].offset >= offset);
-
-	EBUG_ON(l > r);
+		rw_aux_offset(b, t, l - 1) >= offset);
+	EBUG_ON(rw_aux_tree_normalize(b, t, l) != l);
 	EBUG_ON(l > t->size);
 
 	return l;
@@ -838,30 +1081,63 @@ static unsigned bset_ro_tree_capacity(struct btree *b, struct bset_tree *t)
 	return BFLOAT_32BIT_NR + bytes / 5;
 }
 
+/* in entries: */
 static unsigned bset_rw_tree_capacity(struct btree *b, struct bset_tree *t)
 {
-	return __bset_tree_capacity(b, t) / sizeof(struct rw_aux_tree);
+	unsigned bytes = __bset_tree_capacity(b, t);
+
+	/* no room for a whole block - use what there is of one: */
+	if (bytes < sizeof(struct rw_aux_block))
+		return bytes > offsetof(struct rw_aux_block, d)
+			? (bytes - offsetof(struct rw_aux_block, d)) /
+			  sizeof(struct rw_aux_tree)
+			: 0;
+
+	return (bytes / sizeof(struct rw_aux_block)) << RW_AUX_TREE_BLOCK_BITS;
 }
 
 static void __build_rw_aux_tree(struct btree *b, struct bset_tree *t)
 {
-	struct bkey_packed *k;
+	struct rw_aux_block *blk;
+	struct bkey_packed *k, *prev = btree_bkey_first(b, t);
+	unsigned capacity = bset_rw_tree_capacity(b, t);
 
-	t->size = 1;
+	if (!capacity)
+		return;
+
+	t->size = min_t(unsigned, capacity, RW_AUX_TREE_BLOCK);
 	t->extra = BSET_RW_AUX_TREE_VAL;
-	rw_aux_tree(b, t)[0].offset =
-		__btree_node_key_to_offset(b, btree_bkey_first(b, t));
+
+	blk = rw_aux_tree(b, t);
+	blk->shift = 0;
+	blk->nr = 1;
+	blk->d[0] = (struct rw_aux_tree) {
+		.offset	= __btree_node_key_to_offset(b, btree_bkey_first(b, t)),
+		.k	= POS_MIN,
+	};
 
 	for (k = btree_bkey_first(b, t);
 	     k != btree_bkey_last(b, t);
 	     k = bkey_next(k)) {
-		if (t->size == bset_rw_tree_capacity(b, t))
-			break;
+		if ((void *) k - (void *) prev <= L1_CACHE_BYTES)
+			continue;
 
-		if ((void *) k - (void *) rw_aux_to_bkey(b, t, t->size - 1) >
-		    L1_CACHE_BYTES)
-			rw_aux_tree_set(b, t, t->size++, k);
+		if (blk->nr == rw_aux_block_slots(t)) {
+			if (t->size + RW_AUX_TREE_BLOCK > capacity)
+				break;
+
+			t->size += RW_AUX_TREE_BLOCK;
+			blk++;
+			blk->shift = 0;
+			blk->nr = 0;
+		}
+
+		blk->nr++;
+		__rw_aux_block_set(b, t, blk, blk->nr - 1, k);
+		prev = k;
 	}
+
+	rw_aux_block_fill(t, blk);
 }
 
 static void __build_ro_aux_tree(struct btree *b, struct bset_tree *t)
@@ -1062,7 +1338,7 @@ static void rw_aux_tree_fix_invalidated_key(struct btree *b,
 	unsigned j = rw_aux_tree_bsearch(b, t, offset);
 
 	if (j < t->size &&
-	    rw_aux_tree(b, t)[j].offset == offset)
+	    rw_aux_offset(b, t, j) == offset)
 		rw_aux_tree_set(b, t, j, k);
 
 	bch2_bset_verify_rw_aux_tree(b, t);
@@ -1140,6 +1416,147 @@ void bch2_bset_fix_invalidated_key(struct btree *b, struct bset_tree *t,
 	}
 }
 
+static void rw_aux_block_delete_entry(const struct bset_tree *t,
+				      struct rw_aux_block *blk, unsigned i)
+{
+	memmove(&blk->d[i],
+		&blk->d[i + 1],
+		(blk->nr - i - 1) * sizeof(blk->d[0]));
+	blk->nr--;
+	rw_aux_block_fill(t, blk);
+}
+
+/*
+ * Delete entry @j; it can't be the first entry. Returns the index of the entry
+ * after it:
+ */
+static unsigned rw_aux_tree_delete(struct btree *b, struct bset_tree *t,
+				   unsigned j)
+{
+	struct rw_aux_block *blk = rw_aux_tree(b, t);
+	unsigned nr = rw_aux_tree_nr_blocks(t);
+	unsigned m = j >> RW_AUX_TREE_BLOCK_BITS;
+	unsigned i = j & RW_AUX_TREE_BLOCK_MASK;
+
+	EBUG_ON(!j);
+	EBUG_ON(i >= blk[m].nr);
+
+	if (blk[m].nr > 1) {
+		rw_aux_block_delete_entry(t, &blk[m], i);
+		return rw_aux_tree_normalize(b, t, j);
+	}
+
+	/* Don't leave an empty block - refill it from a neighbour: */
+	if (m + 1 < nr && blk[m + 1].nr > 1) {
+		blk[m].d[0] = rw_aux_entry_rebase(b, t, m, m + 1, 0);
+		rw_aux_block_fill(t, &blk[m]);
+		rw_aux_block_delete_entry(t, &blk[m + 1], 0);
+		return j;
+	}
+
+	if (blk[m - 1].nr > 1) {
+		blk[m].d[0] = rw_aux_entry_rebase(b, t, m, m - 1,
+						  blk[m - 1].nr - 1);
+		rw_aux_block_fill(t, &blk[m]);
+		blk[m - 1].nr--;
+		rw_aux_block_fill(t, &blk[m - 1]);
+		return rw_aux_tree_next(b, t, j);
+	}
+
+	/* or drop it: */
+	if (m + 1 < nr) {
+		rw_aux_tree_flatten(b, t);
+		memmove(&blk[m], &blk[m + 1],
+			(nr - m - 1) * sizeof(*blk));
+	}
+	t->size -= RW_AUX_TREE_BLOCK;
+	return j;
+}
+
+/* Insert a new entry before entry @j (or at the end, if @j == t->size): */
+static void rw_aux_tree_insert(struct btree *b, struct bset_tree *t,
+			       unsigned j, struct bkey_packed *k)
+{
+	struct rw_aux_block *blk = rw_aux_tree(b, t);
+	unsigned nr = rw_aux_tree_nr_blocks(t);
+	unsigned slots = rw_aux_block_slots(t);
+	unsigned m = j >> RW_AUX_TREE_BLOCK_BITS;
+	unsigned i = j & RW_AUX_TREE_BLOCK_MASK;
+
+	EBUG_ON(!j);
+
+	/* At the start of a block, prefer the end of the previous block: */
+	if (!i || j == t->size) {
+		m = (j - 1) >> RW_AUX_TREE_BLOCK_BITS;
+		i = blk[m].nr;
+
+		if (i < slots)
+			goto insert;
+
+		m++;
+		i = 0;
+	}
+
+	if (m == nr) {
+		/* appending a new block: */
+		if (t->size + RW_AUX_TREE_BLOCK > bset_rw_tree_capacity(b, t))
+			return;
+
+		t->size += RW_AUX_TREE_BLOCK;
+		blk[m].nr = 0;
+		rw_aux_block_init_shift(b, t, m);
+	} else if (blk[m].nr == slots) {
+		/* Full - make room by moving an entry to a neighbour: */
+		if (m + 1 < nr && blk[m + 1].nr < slots) {
+			memmove(&blk[m + 1].d[1],
+				&blk[m + 1].d[0],
+				blk[m + 1].nr * sizeof(blk->d[0]));
+			blk[m + 1].d[0] = rw_aux_entry_rebase(b, t, m + 1, m,
+							      slots - 1);
+			blk[m + 1].nr++;
+			blk[m].nr--;
+		} else if (m && blk[m - 1].nr < slots) {
+			EBUG_ON(!i);
+
+			blk[m - 1].d[blk[m - 1].nr++] =
+				rw_aux_entry_rebase(b, t, m - 1, m, 0);
+			rw_aux_block_fill(t, &blk[m - 1]);
+			rw_aux_block_delete_entry(t, &blk[m], 0);
+			i--;
+		} else {
+			/* or split it, moving the top half to a new block: */
+			if (t->size + RW_AUX_TREE_BLOCK >
+			    bset_rw_tree_capacity(b, t))
+				return;
+
+			rw_aux_tree_flatten(b, t);
+			memmove(&blk[m + 1], &blk[m],
+				(nr - m) * sizeof(*blk));
+			t->size += RW_AUX_TREE_BLOCK;
+
+			blk[m + 1].nr = RW_AUX_TREE_BLOCK / 2;
+			memmove(&blk[m + 1].d[0],
+				&blk[m + 1].d[RW_AUX_TREE_BLOCK / 2],
+				(RW_AUX_TREE_BLOCK / 2) * sizeof(blk->d[0]));
+			rw_aux_block_fill(t, &blk[m + 1]);
+
+			blk[m].nr = RW_AUX_TREE_BLOCK / 2;
+			rw_aux_block_fill(t, &blk[m]);
+
+			if (i > RW_AUX_TREE_BLOCK / 2) {
+				m++;
+				i -= RW_AUX_TREE_BLOCK / 2;
+			}
+		}
+	}
+insert:
+	memmove(&blk[m].d[i + 1],
+		&blk[m].d[i],
+		(blk[m].nr - i) * sizeof(blk->d[0]));
+	blk[m].nr++;
+	rw_aux_block_set(b, t, &blk[m], i, k);
+}
+
 static void bch2_bset_fix_lookup_table(struct btree *b,
 				       struct bset_tree *t,
 				       struct bkey_packed *_where,
@@ -1147,7 +1564,9 @@ static void bch2_bset_fix_lookup_table(struct btree *b,
 				       unsigned new_u64s)
 {
 	int shift = new_u64s - clobber_u64s;
-	unsigned l, j, where = __btree_node_key_to_offset(b, _where);
+	unsigned l, j, nr_deleted = 0, where = __btree_node_key_to_offset(b, _where);
+	unsigned m;
+	struct rw_aux_block *blk;
 
 	EBUG_ON(bset_has_ro_aux_tree(t));
 
@@ -1158,47 +1577,61 @@ static void bch2_bset_fix_lookup_table(struct btree *b,
 
 	/* l is first >= than @where */
 
-	EBUG_ON(l < t->size && rw_aux_tree(b, t)[l].offset < where);
-	EBUG_ON(l && rw_aux_tree(b, t)[l - 1].offset >= where);
+	EBUG_ON(l < t->size && rw_aux_offset(b, t, l) < where);
+	EBUG_ON(l && rw_aux_offset(b, t, l - 1) >= where);
 
 	if (!l) /* never delete first entry */
-		l++;
+		l = rw_aux_tree_next(b, t, l);
 	else if (l < t->size &&
 		 where < t->end_offset &&
-		 rw_aux_tree(b, t)[l].offset == where)
-		rw_aux_tree_set(b, t, l++, _where);
+		 rw_aux_offset(b, t, l) == where) {
+		rw_aux_tree_set(b, t, l, _where);
+		l = rw_aux_tree_next(b, t, l);
+	}
 
 	/* l now > where */
 
 	for (j = l;
 	     j < t->size &&
-	     rw_aux_tree(b, t)[j].offset < where + clobber_u64s;
-	     j++)
-		;
+	     rw_aux_offset(b, t, j) < where + clobber_u64s;
+	     j = rw_aux_tree_next(b, t, j))
+		nr_deleted++;
 
 	if (j < t->size &&
-	    rw_aux_tree(b, t)[j].offset + shift ==
-	    rw_aux_tree(b, t)[l - 1].offset)
-		j++;
+	    rw_aux_offset(b, t, j) + shift ==
+	    rw_aux_offset(b, t, l - 1))
+		nr_deleted++;
+
+	while (nr_deleted--)
+		l = rw_aux_tree_delete(b, t, l);
 
-	memmove(&rw_aux_tree(b, t)[l],
-		&rw_aux_tree(b, t)[j],
-		(void *) &rw_aux_tree(b, t)[t->size] -
-		(void *) &rw_aux_tree(b, t)[j]);
-	t->size -= j - l;
+	/*
+	 * Entries after l in its block are shifted individually, blocks after
+	 * that via their shift:
+	 */
+	if (l < t->size) {
+		m = l >> RW_AUX_TREE_BLOCK_BITS;
+
+		if (l & RW_AUX_TREE_BLOCK_MASK) {
+			blk = rw_aux_tree(b, t) + m++;
+
+			for (j = l & RW_AUX_TREE_BLOCK_MASK;
+			     j < rw_aux_block_slots(t);
+			     j++)
+				blk->d[j].offset += shift;
+		}
 
-	for (j = l; j < t->size; j++)
-	       rw_aux_tree(b, t)[j].offset += shift;
+		rw_aux_blocks_shift(b, t, m, shift);
+	}
 
 	EBUG_ON(l < t->size &&
-		rw_aux_tree(b, t)[l].offset ==
-		rw_aux_tree(b, t)[l - 1].offset);
+		rw_aux_offset(b, t, l) ==
+		rw_aux_offset(b, t, l - 1));
 
-	if (t->size < bset_rw_tree_capacity(b, t) &&
-	    (l < t->size
-	     ? rw_aux_tree(b, t)[l].offset
+	if ((l < t->size
+	     ? rw_aux_offset(b, t, l)
 	     : t->end_offset) -
-	    rw_aux_tree(b, t)[l - 1].offset >
+	    rw_aux_offset(b, t, l - 1) >
 	    L1_CACHE_BYTES / sizeof(u64)) {
 		struct bkey_packed *start = rw_aux_to_bkey(b, t, l - 1);
 		struct bkey_packed *end = l < t->size
@@ -1212,12 +1645,7 @@ static void bch2_bset_fix_lookup_table(struct btree *b,
 				break;
 
 			if ((void *) k - (void *) start >= L1_CACHE_BYTES) {
-				memmove(&rw_aux_tree(b, t)[l + 1],
-					&rw_aux_tree(b, t)[l],
-					(void *) &rw_aux_tree(b, t)[t->size] -
-					(void *) &rw_aux_tree(b, t)[l]);
-				t->size++;
-				rw_aux_tree_set(b, t, l, k);
+				rw_aux_tree_insert(b, t, l, k);
 				break;
 			}
 		}
@@ -1295,18 +1723,38 @@ static struct bkey_packed *bset_search_write_set(const struct btree *b,
 				struct bpos search,
 				const struct bkey_packed *packed_search)
 {
-	unsigned l = 0, r = t->size;
+	struct rw_aux_block *blk = rw_aux_tree(b, t);
+	unsigned n, l = 0, r = rw_aux_tree_nr_blocks(t);
+
+	/* Sequential inserts append - check the end first: */
+	if (bkey_cmp(rw_aux_entry(b, t, t->size - 1)->k, search) < 0)
+		return rw_aux_to_bkey(b, t, t->size - 1);
+
+	while (l + 1 < r) {
+		unsigned m = (l + r) >> 1;
+
+		if (bkey_cmp(blk[m].d[0].k, search) < 0)
+			l = m;
+		else
+			r = m;
+	}
+
+	n = l;
+	blk += n;
+	l = 0;
+	r = rw_aux_block_slots(t);
 
 	while (l + 1 != r) {
 		unsigned m = (l + r) >> 1;
 
-		if (bkey_cmp(rw_aux_tree(b, t)[m].k, search) < 0)
+		if (bkey_cmp(blk->d[m].k, search) < 0)
 			l = m;
 		else
 			r = m;
 	}
 
-	return rw_aux_to_bkey(b, t, l);
+	return __btree_node_offset_to_key(b, (u16) (blk->d[l].offset +
+				rw_aux_block_shift(b, t, n)));
 }
 
 noinline
@@ -1319,6 +1767,65 @@ static int bset_search_tree_slowpath(const struct btree *b,
 				 packed_search, search) < 0;
 }
 
+static inline unsigned bfloat_cmp(struct ro_aux_tree *base, unsigned idx,
+				  const struct bkey_packed *search,
+				  unsigned *failed)
+{
+	const struct bkey_float *f = bkey_float_get(base, idx);
+
+	*failed |= f->exponent >= BFLOAT_FAILED;
+	return bfloat_mantissa(f, idx) < bkey_mantissa(search, f, idx);
+}
+
+/*
+ * Descend three levels of the tree at once: the seven nodes involved (n, its
+ * two children, its four grandchildren) don't depend on each other, so we
+ * compare all of them and then pick the path - instead of a chain of dependent
+ * loads and compares, one per level. The nodes of the next block are
+ * prefetched while we're working on this one.
+ *
+ * Returns false if any of the nodes couldn't be compared with the packed
+ * search key, in which case the caller does it the slow way.
+ */
+static inline bool bset_search_tree_block(const struct btree *b,
+				struct bset_tree *t,
+				struct ro_aux_tree *base,
+				const struct bkey_packed *packed_search,
+				unsigned *_n)
+{
+	unsigned n = *_n, failed = 0, c0, c1, c2;
+
+	if (n << 5 < t->size) {
+		prefetch(bkey_float_get(base, n << 3));
+		prefetch(bkey_float_get(base, n << 4));
+		prefetch(bkey_float_get(base, n << 5));
+		prefetch((void *) bkey_float_get(base, n << 5) + L1_CACHE_BYTES);
+	} else {
+		void *p = bset_cacheline(b, t,
+				__eytzinger1_to_inorder(n, t->size, t->extra));
+
+		prefetch(p - BSET_CACHELINE);
+		prefetch(p);
+		prefetch(p + BSET_CACHELINE);
+	}
+
+	c0  = bfloat_cmp(base, n, packed_search, &failed);
+	c1  = bfloat_cmp(base, (n << 1) + 0, packed_search, &failed) << 0;
+	c1 |= bfloat_cmp(base, (n << 1) + 1, packed_search, &failed) << 1;
+	c2  = bfloat_cmp(base, (n << 2) + 0, packed_search, &failed) << 0;
+	c2 |= bfloat_cmp(base, (n << 2) + 1, packed_search, &failed) << 1;
+	c2 |= bfloat_cmp(base, (n << 2) + 2, packed_search, &failed) << 2;
+	c2 |= bfloat_cmp(base, (n << 2) + 3, packed_search, &failed) << 3;
+	if (failed)
+		return false;
+
+	n = n * 2 + c0;
+	n = n * 2 + ((c1 >> (n & 1)) & 1);
+	n = n * 2 + ((c2 >> (n & 3)) & 1);
+	*_n = n;
+	return true;
+}
+
 __flatten
 static struct bkey_packed *bset_search_tree(const struct btree *b,
 				struct bset_tree *t,
@@ -1331,6 +1838,15 @@ static struct bkey_packed *bset_search_tree(const struct btree *b,
 	unsigned inorder, n = 1;
 
 	while (1) {
+		if (packed_search &&
+		    (n << 2) + 3 < t->size &&
+		    bset_search_tree_block(b, t, base, packed_search, &n)) {
+			f = bkey_float_get(base, n >> 1);
+			if (n >= t->size)
+				break;
+			continue;
+		}
+
 		if (likely(n << 4 < t->size)) {
 			p = bkey_float_get(base, n << 4);
 			prefetch(p);
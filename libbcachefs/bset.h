@@ -194,25 +194,23 @@ __bkey_unpack_key_format_checked(const struct btree *b,
 			       const struct bkey_packed *src)
 {
 #ifdef HAVE_BCACHEFS_COMPILED_UNPACK
-	{
-		compiled_unpack_fn unpack_fn = b->aux_data;
-		unpack_fn(dst, src);
+	compiled_unpack_fn unpack_fn = b->aux_data;
+	unpack_fn(dst, src);
+#else
+	*dst = bkey_unpack_key_table(b->aux_data, &b->format, src);
+#endif
 
-		if (btree_keys_expensive_checks(b)) {
-			struct bkey dst2 = __bch2_bkey_unpack_key(&b->format, src);
+	if (btree_keys_expensive_checks(b)) {
+		struct bkey dst2 = __bch2_bkey_unpack_key(&b->format, src);
 
-			/*
-			 * hack around a harmless race when compacting whiteouts
-			 * for a write:
-			 */
-			dst2.needs_whiteout = dst->needs_whiteout;
+		/*
+		 * hack around a harmless race when compacting whiteouts
+		 * for a write:
+		 */
+		dst2.needs_whiteout = dst->needs_whiteout;
 
-			BUG_ON(memcmp(dst, &dst2, sizeof(*dst)));
-		}
+		BUG_ON(memcmp(dst, &dst2, sizeof(*dst)));
 	}
-#else
-	*dst = __bch2_bkey_unpack_key(&b->format, src);
-#endif
 }
 
 static inline struct bkey
@@ -253,7 +251,7 @@ bkey_unpack_pos_format_checked(const struct btree *b,
 #ifdef HAVE_BCACHEFS_COMPILED_UNPACK
 	return bkey_unpack_key_format_checked(b, src).p;
 #else
-	return __bkey_unpack_pos(&b->format, src);
+	return bkey_unpack_pos_table(b->aux_data, src);
 #endif
 }
 
@@ -353,6 +351,42 @@ void bch2_bset_delete(struct btree *, struct bkey_packed *, unsigned);
 
 /* Bkey utility code */
 
+/*
+ * Keys packed with the node's format compare as one big integer, most
+ * significant word first: returns its first 64 bits, left aligned, with any
+ * non key bits masked off:
+ */
+static inline u64 bkey_packed_prefix(const struct btree *b,
+				     const struct bkey_packed *k)
+{
+	u64 v = *high_word(&b->format, k) << high_bit_offset;
+
+	return b->nr_key_bits < 64 - high_bit_offset
+		? v & ~(~0ULL >> b->nr_key_bits)
+		: v;
+}
+
+/*
+ * For sorting: most keys differ in their first word, so compare that inline
+ * and only go out of line when it's equal or a key is unpacked:
+ */
+static inline int bkey_cmp_packed_inline(const struct btree *b,
+					 const struct bkey_packed *l,
+					 const struct bkey_packed *r)
+{
+	if (likely(bkey_packed(l) && bkey_packed(r))) {
+		u64 l_v = bkey_packed_prefix(b, l);
+		u64 r_v = bkey_packed_prefix(b, r);
+
+		if (b->nr_key_bits > 64 - high_bit_offset && l_v == r_v)
+			return __bch2_bkey_cmp_packed_format_checked(l, r, b);
+
+		return (l_v > r_v) - (l_v < r_v);
+	}
+
+	return __bch2_bkey_cmp_packed(l, r, b);
+}
+
 /* packed or unpacked */
 static inline int bkey_cmp_p_or_unp(const struct btree *b,
 				    const struct bkey_packed *l,
@@ -473,7 +507,7 @@ static inline int __btree_node_iter_cmp(bool is_extents,
 	 * For extents, bkey_deleted() is used as a proxy for k->size == 0, so
 	 * deleted keys have to sort last.
 	 */
-	return bkey_cmp_packed(b, l, r) ?: is_extents
+	return bkey_cmp_packed_inline(b, l, r) ?: is_extents
 		? (int) bkey_deleted(l) - (int) bkey_deleted(r)
 		: (int) bkey_deleted(r) - (int) bkey_deleted(l);
 }
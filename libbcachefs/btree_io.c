@@ -166,7 +166,7 @@ static inline int sort_key_whiteouts_cmp(struct btree *b,
 					 struct bkey_packed *l,
 					 struct bkey_packed *r)
 {
-	return bkey_cmp_packed(b, l, r);
+	return bkey_cmp_packed_inline(b, l, r);
 }
 
 static unsigned sort_key_whiteouts(struct bkey_packed *dst,
@@ -465,7 +465,7 @@ static inline int sort_keys_cmp(struct btree *b,
 				struct bkey_packed *l,
 				struct bkey_packed *r)
 {
-	return bkey_cmp_packed(b, l, r) ?:
+	return bkey_cmp_packed_inline(b, l, r) ?:
 		(int) bkey_whiteout(r) - (int) bkey_whiteout(l) ?:
 		(int) l->needs_whiteout - (int) r->needs_whiteout;
 }
@@ -486,7 +486,7 @@ static unsigned sort_keys(struct bkey_packed *dst,
 
 		if (bkey_whiteout(in) &&
 		    (next = sort_iter_peek(iter)) &&
-		    !bkey_cmp_packed(iter->b, in, next)) {
+		    !bkey_cmp_packed_inline(iter->b, in, next)) {
 			BUG_ON(in->needs_whiteout &&
 			       next->needs_whiteout);
 			/*
@@ -515,7 +515,7 @@ static inline int sort_extents_cmp(struct btree *b,
 				   struct bkey_packed *l,
 				   struct bkey_packed *r)
 {
-	return bkey_cmp_packed(b, l, r) ?:
+	return bkey_cmp_packed_inline(b, l, r) ?:
 		(int) bkey_deleted(l) - (int) bkey_deleted(r);
 }
 
@@ -748,12 +748,18 @@ static void btree_iter_prefetch(struct btree_iter *iter)
 	struct btree_node_iter node_iter = l->iter;
 	struct bkey_packed *k;
 	BKEY_PADDED(k) tmp;
+	struct blk_plug plug;
 	unsigned nr = iter->level > 1 ? 1 : 8;
 	bool was_locked = btree_node_locked(iter, iter->level);
 
+	/* sibling nodes are often adjacent on disk, let their reads merge: */
+	blk_start_plug(&plug);
+
 	while (nr) {
-		if (!bch2_btree_node_relock(iter, iter->level))
+		if (!bch2_btree_node_relock(iter, iter->level)) {
+			blk_finish_plug(&plug);
 			return;
+		}
 
 		bch2_btree_node_iter_advance(&node_iter, l->b);
 		k = bch2_btree_node_iter_peek(&node_iter, l->b);
@@ -766,6 +772,8 @@ static void btree_iter_prefetch(struct btree_iter *iter)
 					 iter->btree_id);
 	}
 
+	blk_finish_plug(&plug);
+
 	if (!was_locked)
 		btree_node_unlock(iter, iter->level);
 }
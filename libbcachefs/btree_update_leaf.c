@@ -202,6 +202,11 @@ btree_insert_key_leaf(struct btree_insert *trans,
 
 	btree_iter_set_dirty(iter, BTREE_ITER_NEED_PEEK);
 
+	if (bch2_btree_node_iter_end(&iter->l[0].iter))
+		this_cpu_inc(c->btree_insert_stats->appends);
+	else
+		this_cpu_inc(c->btree_insert_stats->searches);
+
 	ret = !btree_node_is_extents(b)
 		? bch2_insert_fixup_key(trans, insert)
 		: bch2_insert_fixup_extent(trans, insert);
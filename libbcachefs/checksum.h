@@ -36,6 +36,9 @@ int bch2_request_key(struct bch_sb *, struct bch_key *);
 void bch2_encrypt(struct bch_fs *, unsigned, struct nonce,
 		 void *data, size_t);
 
+struct bch_csum __bch2_checksum_bio(struct bch_fs *, unsigned,
+				    struct nonce, struct bio *,
+				    struct bvec_iter *);
 struct bch_csum bch2_checksum_bio(struct bch_fs *, unsigned,
 				  struct nonce, struct bio *);
 
@@ -45,6 +48,8 @@ int bch2_rechecksum_bio(struct bch_fs *, struct bio *, struct bversion,
 			struct bch_extent_crc_unpacked *,
 			unsigned, unsigned, unsigned);
 
+void __bch2_encrypt_bio(struct bch_fs *, unsigned, struct nonce,
+			struct bio *, struct bvec_iter);
 void bch2_encrypt_bio(struct bch_fs *, unsigned,
 		    struct nonce, struct bio *);
 
@@ -101,6 +106,8 @@ bch2_compression_opt_to_type(enum bch_compression_opts type)
 		return BCH_COMPRESSION_LZ4;
 	case BCH_COMPRESSION_OPT_GZIP:
 		return BCH_COMPRESSION_GZIP;
+	case BCH_COMPRESSION_OPT_ZSTD:
+		return BCH_COMPRESSION_ZSTD;
 	default:
 	     BUG();
 	}
@@ -12,32 +12,33 @@ static inline long io_timer_cmp(io_timer_heap *h,
 	return l->expire - r->expire;
 }
 
-void bch2_io_timer_add(struct io_clock *clock, struct io_timer *timer)
+static void io_timer_set_backpointer(io_timer_heap *h, size_t i)
 {
-	size_t i;
+	h->data[i]->heap_idx = i;
+}
 
-	spin_lock(&clock->timer_lock);
-	for (i = 0; i < clock->timers.used; i++)
-		if (clock->timers.data[i] == timer)
-			goto out;
+/* heap_idx is stale once a timer is off the heap, so check it points back: */
+static bool io_timer_on_heap(struct io_clock *clock, struct io_timer *timer)
+{
+	return timer->heap_idx < clock->timers.used &&
+		clock->timers.data[timer->heap_idx] == timer;
+}
 
-	BUG_ON(!heap_add(&clock->timers, timer, io_timer_cmp));
-out:
+void bch2_io_timer_add(struct io_clock *clock, struct io_timer *timer)
+{
+	spin_lock(&clock->timer_lock);
+	if (!io_timer_on_heap(clock, timer))
+		BUG_ON(!heap_add(&clock->timers, timer, io_timer_cmp,
+				 io_timer_set_backpointer));
 	spin_unlock(&clock->timer_lock);
 }
 
 void bch2_io_timer_del(struct io_clock *clock, struct io_timer *timer)
 {
-	size_t i;
-
 	spin_lock(&clock->timer_lock);
-
-	for (i = 0; i < clock->timers.used; i++)
-		if (clock->timers.data[i] == timer) {
-			heap_del(&clock->timers, i, io_timer_cmp);
-			break;
-		}
-
+	if (io_timer_on_heap(clock, timer))
+		heap_del(&clock->timers, timer->heap_idx, io_timer_cmp,
+			 io_timer_set_backpointer);
 	spin_unlock(&clock->timer_lock);
 }
 
@@ -112,7 +113,8 @@ static struct io_timer *get_expired_timer(struct io_clock *clock,
 
 	if (clock->timers.used &&
 	    time_after_eq(now, clock->timers.data[0]->expire))
-		heap_pop(&clock->timers, ret, io_timer_cmp);
+		heap_pop(&clock->timers, ret, io_timer_cmp,
+			 io_timer_set_backpointer);
 
 	spin_unlock(&clock->timer_lock);
 
@@ -17,6 +17,8 @@ typedef void (*io_timer_fn)(struct io_timer *);
 struct io_timer {
 	io_timer_fn		fn;
 	unsigned long		expire;
+	/* position in io_clock->timers, only valid while it's on the heap: */
+	size_t			heap_idx;
 };
 
 /* Amount to buffer up on a percpu counter */
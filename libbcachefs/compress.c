@@ -8,6 +8,7 @@
 #include "lz4.h"
 #include <linux/lz4.h>
 #include <linux/zlib.h>
+#include <linux/zstd.h>
 
 /* Bounce buffer: */
 struct bbuf {
@@ -112,6 +113,11 @@ bounce:
 	return ret;
 }
 
+static inline bool bbuf_bounced(struct bbuf buf)
+{
+	return buf.type != BB_NONE && buf.type != BB_VMAP;
+}
+
 static struct bbuf bio_map_or_bounce(struct bch_fs *c, struct bio *bio, int rw)
 {
 	return __bio_map_or_bounce(c, bio, bio->bi_iter, rw);
@@ -145,14 +151,86 @@ static inline void zlib_set_workspace(z_stream *strm, void *workspace)
 #endif
 }
 
+/*
+ * Workspaces are shared by compression and decompression and by all the
+ * algorithms - they're sized for the biggest one that's enabled. Up to one per
+ * cpu is allocated on demand and then cached; past that, we wait for one to be
+ * freed. While the cache is being resized compress_workspaces_max is 0, and
+ * nothing is handed out:
+ */
+static void *workspace_get(struct bch_fs *c)
+{
+	void *ws;
+
+	spin_lock(&c->compress_workspace_lock);
+	while (1) {
+		if (c->compress_workspaces_free &&
+		    c->compress_workspaces_max) {
+			ws = c->compress_workspaces[--c->compress_workspaces_free];
+			spin_unlock(&c->compress_workspace_lock);
+
+			atomic_long_inc(&c->compress_workspace_hits);
+			return ws;
+		}
+
+		if (c->compress_workspaces_nr < c->compress_workspaces_max) {
+			c->compress_workspaces_nr++;
+			spin_unlock(&c->compress_workspace_lock);
+
+			ws = kvpmalloc(c->compress_workspace_size,
+				       GFP_NOIO|__GFP_NOWARN);
+			if (ws) {
+				atomic_long_inc(&c->compress_workspace_misses);
+				return ws;
+			}
+
+			spin_lock(&c->compress_workspace_lock);
+			c->compress_workspaces_nr--;
+			/* a resize may be waiting for this one: */
+			wake_up(&c->compress_workspace_wait);
+		}
+
+		atomic_long_inc(&c->compress_workspace_waits);
+		spin_unlock(&c->compress_workspace_lock);
+
+		wait_event(c->compress_workspace_wait,
+			   READ_ONCE(c->compress_workspaces_free) &&
+			   READ_ONCE(c->compress_workspaces_max));
+
+		spin_lock(&c->compress_workspace_lock);
+	}
+}
+
+static void workspace_put(struct bch_fs *c, void *ws)
+{
+	spin_lock(&c->compress_workspace_lock);
+	c->compress_workspaces[c->compress_workspaces_free++] = ws;
+	spin_unlock(&c->compress_workspace_lock);
+
+	wake_up(&c->compress_workspace_wait);
+}
+
+/*
+ * gzip can stop once it's produced the data we want, instead of decompressing
+ * the whole extent - lz4's partial decoding can't stop at an arbitrary point,
+ * it fails when a literal run or match crosses the end of the output buffer:
+ */
+static bool decompress_can_stop_early(unsigned type)
+{
+	return type == BCH_COMPRESSION_GZIP;
+}
+
 static int __bio_uncompress(struct bch_fs *c, struct bio *src,
-			    void *dst_data, struct bch_extent_crc_unpacked crc)
+			    void *dst_data, size_t dst_len,
+			    struct bch_extent_crc_unpacked crc)
 {
 	struct bbuf src_data = { NULL };
 	size_t src_len = src->bi_iter.bi_size;
-	size_t dst_len = crc.uncompressed_size << 9;
+	bool partial = dst_len < crc.uncompressed_size << 9;
 	int ret;
 
+	BUG_ON(partial && !decompress_can_stop_early(crc.compression_type));
+
 	src_data = bio_map_or_bounce(c, src, READ);
 
 	switch (crc.compression_type) {
@@ -173,16 +251,9 @@ static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 		}
 		break;
 	case BCH_COMPRESSION_GZIP: {
-		void *workspace;
+		void *workspace = workspace_get(c);
 		z_stream strm;
 
-		workspace = kmalloc(zlib_inflate_workspacesize(),
-				    GFP_NOIO|__GFP_NOWARN);
-		if (!workspace) {
-			mutex_lock(&c->zlib_workspace_lock);
-			workspace = c->zlib_workspace;
-		}
-
 		strm.next_in	= src_data.b;
 		strm.avail_in	= src_len;
 		strm.next_out	= dst_data;
@@ -192,12 +263,38 @@ static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 
 		ret = zlib_inflate(&strm, Z_FINISH);
 
-		if (workspace == c->zlib_workspace)
-			mutex_unlock(&c->zlib_workspace_lock);
-		else
-			kfree(workspace);
+		workspace_put(c, workspace);
 
-		if (ret != Z_STREAM_END) {
+		/* running out of output space is expected if we stopped early: */
+		if (ret != Z_STREAM_END &&
+		    !(partial && ret == Z_BUF_ERROR && !strm.avail_out)) {
+			ret = -EIO;
+			goto err;
+		}
+		break;
+	}
+	case BCH_COMPRESSION_ZSTD: {
+		ZSTD_DCtx *ctx;
+		void *workspace;
+		size_t len;
+
+		/* compressed size is stored in the first 4 bytes: */
+		if (src_len < 4 ||
+		    le32_to_cpup(src_data.b) > src_len - 4) {
+			ret = -EIO;
+			goto err;
+		}
+
+		workspace = workspace_get(c);
+		ctx = ZSTD_initDCtx(workspace, c->compress_workspace_size);
+
+		len = ZSTD_decompressDCtx(ctx,
+				dst_data,	dst_len,
+				src_data.b + 4,	le32_to_cpup(src_data.b));
+
+		workspace_put(c, workspace);
+
+		if (len != dst_len) {
 			ret = -EIO;
 			goto err;
 		}
@@ -218,6 +315,9 @@ int bch2_bio_uncompress_inplace(struct bch_fs *c, struct bio *bio,
 	struct bbuf data = { NULL };
 	size_t dst_len = crc->uncompressed_size << 9;
 
+	if (decompress_can_stop_early(crc->compression_type))
+		dst_len = (crc->offset + crc->live_size) << 9;
+
 	/* bio must own its pages: */
 	BUG_ON(!bio->bi_vcnt);
 	BUG_ON(DIV_ROUND_UP(crc->live_size, PAGE_SECTORS) > bio->bi_max_vecs);
@@ -230,7 +330,7 @@ int bch2_bio_uncompress_inplace(struct bch_fs *c, struct bio *bio,
 
 	data = __bounce_alloc(c, dst_len, WRITE);
 
-	if (__bio_uncompress(c, bio, data.b, *crc)) {
+	if (__bio_uncompress(c, bio, data.b, dst_len, *crc)) {
 		bch_err(c, "error rewriting existing data: decompression error");
 		bio_unmap_or_unbounce(c, data);
 		return -EIO;
@@ -267,37 +367,101 @@ int bch2_bio_uncompress(struct bch_fs *c, struct bio *src,
 	    crc.compressed_size		> c->sb.encoded_extent_max)
 		return -EIO;
 
+	if (decompress_can_stop_early(crc.compression_type))
+		dst_len = (crc.offset + crc.live_size) << 9;
+
+	/*
+	 * If we want everything up to the point where decompression stops, we
+	 * can decompress directly into @dst:
+	 */
 	dst_data = dst_len == dst_iter.bi_size
 		? __bio_map_or_bounce(c, dst, dst_iter, WRITE)
 		: __bounce_alloc(c, dst_len, WRITE);
 
-	ret = __bio_uncompress(c, src, dst_data.b, crc);
+	ret = __bio_uncompress(c, src, dst_data.b, dst_len, crc);
 	if (ret)
 		goto err;
 
-	if (dst_data.type != BB_NONE)
+	if (bbuf_bounced(dst_data))
 		memcpy_to_bio(dst, dst_iter, dst_data.b + (crc.offset << 9));
 err:
 	bio_unmap_or_unbounce(c, dst_data);
 	return ret;
 }
 
+/*
+ * Cheap compressibility estimate, so we don't run the compressor on data that's
+ * already compressed or encrypted: sample a few chunks, and look at the byte
+ * entropy and how often bytes repeat at short distances.
+ */
+#define COMPRESS_SAMPLE_CHUNK		64
+#define COMPRESS_SAMPLES		32
+/* bits per byte, 8.8 fixed point: */
+#define COMPRESS_ENTROPY_MAX		((7 << 8) + 128)
+/* every nth skipped extent is compressed anyway, to see if we were wrong: */
+#define COMPRESS_SKIP_AUDIT		64
+
+/* log2 in 8.8 fixed point, linearly interpolating the mantissa: */
+static unsigned log2_fp8(unsigned x)
+{
+	unsigned i = ilog2(x);
+
+	return (i << 8) + (((x << 8) >> i) & 255);
+}
+
+static bool bch2_compress_worthwhile(const u8 *data, size_t len)
+{
+	unsigned hist[256] = { 0 };
+	unsigned n = 0, repeats = 0;
+	size_t i, j, stride = max_t(size_t, len / COMPRESS_SAMPLES,
+				    COMPRESS_SAMPLE_CHUNK);
+	u64 sum = 0;
+
+	for (i = 0; i + COMPRESS_SAMPLE_CHUNK <= len; i += stride)
+		for (j = i; j < i + COMPRESS_SAMPLE_CHUNK; j++, n++) {
+			hist[data[j]]++;
+			repeats += j >= i + 4 &&
+				(data[j] == data[j - 1] ||
+				 data[j] == data[j - 4]);
+		}
+
+	if (!n || repeats * 8 > n)
+		return true;
+
+	for (i = 0; i < ARRAY_SIZE(hist); i++)
+		if (hist[i])
+			sum += hist[i] * log2_fp8(hist[i]);
+
+	return log2_fp8(n) - div_u64(sum, n) < COMPRESS_ENTROPY_MAX;
+}
+
 static unsigned __bio_compress(struct bch_fs *c,
 			       struct bio *dst, size_t *dst_len,
 			       struct bio *src, size_t *src_len,
 			       unsigned compression_type)
 {
 	struct bbuf src_data = { NULL }, dst_data = { NULL };
+	bool audit = false;
 	unsigned pad;
 	int ret = 0;
 
 	/* If it's only one block, don't bother trying to compress: */
 	if (bio_sectors(src) <= c->opts.block_size)
-		goto err;
+		return 0;
 
-	dst_data = bio_map_or_bounce(c, dst, WRITE);
 	src_data = bio_map_or_bounce(c, src, READ);
 
+	if (!bch2_compress_worthwhile(src_data.b, src->bi_iter.bi_size)) {
+		if (atomic_long_inc_return(&c->compress_skipped) %
+		    COMPRESS_SKIP_AUDIT)
+			goto out_nocompress;
+
+		atomic_long_inc(&c->compress_skip_audits);
+		audit = true;
+	}
+
+	dst_data = bio_map_or_bounce(c, dst, WRITE);
+
 	switch (compression_type) {
 	case BCH_COMPRESSION_LZ4_OLD:
 		compression_type = BCH_COMPRESSION_LZ4;
@@ -306,7 +470,7 @@ static unsigned __bio_compress(struct bch_fs *c,
 		void *workspace;
 		int len = src->bi_iter.bi_size;
 
-		workspace = mempool_alloc(&c->lz4_workspace_pool, GFP_NOIO);
+		workspace = workspace_get(c);
 
 		while (1) {
 			if (len <= block_bytes(c)) {
@@ -328,7 +492,7 @@ static unsigned __bio_compress(struct bch_fs *c,
 				break;
 			len = round_down(len, block_bytes(c));
 		}
-		mempool_free(workspace, &c->lz4_workspace_pool);
+		workspace_put(c, workspace);
 
 		if (!ret)
 			goto err;
@@ -339,24 +503,19 @@ static unsigned __bio_compress(struct bch_fs *c,
 		break;
 	}
 	case BCH_COMPRESSION_GZIP: {
-		void *workspace;
+		void *workspace = workspace_get(c);
 		z_stream strm;
 
-		workspace = kmalloc(zlib_deflate_workspacesize(MAX_WBITS,
-							       DEF_MEM_LEVEL),
-				    GFP_NOIO|__GFP_NOWARN);
-		if (!workspace) {
-			mutex_lock(&c->zlib_workspace_lock);
-			workspace = c->zlib_workspace;
-		}
-
 		strm.next_in	= src_data.b;
 		strm.avail_in	= min(src->bi_iter.bi_size,
 				      dst->bi_iter.bi_size);
 		strm.next_out	= dst_data.b;
 		strm.avail_out	= dst->bi_iter.bi_size;
 		zlib_set_workspace(&strm, workspace);
-		zlib_deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+		zlib_deflateInit2(&strm, c->opts.compression_level
+				  ? min_t(int, c->opts.compression_level,
+					  Z_BEST_COMPRESSION)
+				  : Z_DEFAULT_COMPRESSION,
 				  Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL,
 				  Z_DEFAULT_STRATEGY);
 
@@ -374,10 +533,7 @@ static unsigned __bio_compress(struct bch_fs *c,
 
 		ret = 0;
 zlib_err:
-		if (workspace == c->zlib_workspace)
-			mutex_unlock(&c->zlib_workspace_lock);
-		else
-			kfree(workspace);
+		workspace_put(c, workspace);
 
 		if (ret)
 			goto err;
@@ -386,6 +542,29 @@ zlib_err:
 		*src_len = strm.total_in;
 		break;
 	}
+	case BCH_COMPRESSION_ZSTD: {
+		ZSTD_CCtx *ctx;
+		void *workspace;
+		size_t len;
+
+		workspace = workspace_get(c);
+		ctx = ZSTD_initCCtx(workspace, c->compress_workspace_size);
+
+		len = ZSTD_compressCCtx(ctx,
+				dst_data.b + 4,	dst->bi_iter.bi_size - 4,
+				src_data.b,	src->bi_iter.bi_size,
+				c->zstd_params);
+
+		workspace_put(c, workspace);
+
+		if (ZSTD_isError(len))
+			goto err;
+
+		*(__le32 *) dst_data.b = cpu_to_le32(len);
+		*dst_len = len + 4;
+		*src_len = src->bi_iter.bi_size;
+		break;
+	}
 	default:
 		BUG();
 	}
@@ -406,11 +585,17 @@ zlib_err:
 	BUG_ON(!*src_len || *src_len > src->bi_iter.bi_size);
 	BUG_ON(*dst_len & (block_bytes(c) - 1));
 	BUG_ON(*src_len & (block_bytes(c) - 1));
+
+	if (audit)
+		atomic_long_inc(&c->compress_skip_wrong);
 out:
 	bio_unmap_or_unbounce(c, src_data);
 	bio_unmap_or_unbounce(c, dst_data);
 	return compression_type;
 err:
+	if (!audit)
+		atomic_long_inc(&c->compress_wasted);
+out_nocompress:
 	compression_type = 0;
 	goto out;
 }
@@ -456,6 +641,12 @@ int bch2_check_set_has_compressed_data(struct bch_fs *c,
 
 		bch2_sb_set_feature(c->disk_sb, BCH_FEATURE_GZIP);
 		break;
+	case BCH_COMPRESSION_OPT_ZSTD:
+		if (bch2_sb_test_feature(c->disk_sb, BCH_FEATURE_ZSTD))
+			return 0;
+
+		bch2_sb_set_feature(c->disk_sb, BCH_FEATURE_ZSTD);
+		break;
 	default:
 		BUG();
 	}
@@ -465,15 +656,91 @@ int bch2_check_set_has_compressed_data(struct bch_fs *c,
 
 void bch2_fs_compress_exit(struct bch_fs *c)
 {
-	vfree(c->zlib_workspace);
-	mempool_exit(&c->lz4_workspace_pool);
+	while (c->compress_workspaces_free)
+		kvpfree(c->compress_workspaces[--c->compress_workspaces_free],
+			c->compress_workspace_size);
+	kfree(c->compress_workspaces);
+	c->compress_workspaces = NULL;
+
 	mempool_exit(&c->compression_bounce[WRITE]);
 	mempool_exit(&c->compression_bounce[READ]);
 }
 
-#define COMPRESSION_WORKSPACE_SIZE					\
-	max_t(size_t, zlib_inflate_workspacesize(),			\
-	      zlib_deflate_workspacesize(MAX_WBITS, DEF_MEM_LEVEL))
+static size_t compress_workspace_size(struct bch_fs *c)
+{
+	size_t ret = 0;
+
+	if (bch2_sb_test_feature(c->disk_sb, BCH_FEATURE_LZ4))
+		ret = max_t(size_t, ret, LZ4_MEM_COMPRESS);
+
+	if (bch2_sb_test_feature(c->disk_sb, BCH_FEATURE_GZIP)) {
+		ret = max_t(size_t, ret, zlib_inflate_workspacesize());
+		ret = max_t(size_t, ret,
+			    zlib_deflate_workspacesize(MAX_WBITS, DEF_MEM_LEVEL));
+	}
+
+	if (bch2_sb_test_feature(c->disk_sb, BCH_FEATURE_ZSTD)) {
+		ret = max_t(size_t, ret,
+			    ZSTD_CCtxWorkspaceBound(c->zstd_params.cParams));
+		ret = max_t(size_t, ret, ZSTD_DCtxWorkspaceBound());
+	}
+
+	return ret;
+}
+
+/*
+ * Called when a new compression type is enabled: wait for every workspace to
+ * come back, free them, and preallocate one at the new size:
+ */
+static int compress_workspaces_resize(struct bch_fs *c, size_t size)
+{
+	unsigned max, nr;
+	void *ws;
+
+	spin_lock(&c->compress_workspace_lock);
+	max = c->compress_workspaces_max;
+	c->compress_workspaces_max = 0;
+	spin_unlock(&c->compress_workspace_lock);
+
+	while (1) {
+		spin_lock(&c->compress_workspace_lock);
+		ws = NULL;
+		if (c->compress_workspaces_free) {
+			ws = c->compress_workspaces[--c->compress_workspaces_free];
+			c->compress_workspaces_nr--;
+		}
+		nr = c->compress_workspaces_nr;
+		spin_unlock(&c->compress_workspace_lock);
+
+		if (ws) {
+			kvpfree(ws, c->compress_workspace_size);
+			continue;
+		}
+
+		if (!nr)
+			break;
+
+		wait_event(c->compress_workspace_wait,
+			   READ_ONCE(c->compress_workspaces_free) ||
+			   !READ_ONCE(c->compress_workspaces_nr));
+	}
+
+	c->compress_workspace_size = size;
+
+	ws = kvpmalloc(size, GFP_KERNEL);
+
+	spin_lock(&c->compress_workspace_lock);
+	if (ws) {
+		c->compress_workspaces[c->compress_workspaces_free++] = ws;
+		c->compress_workspaces_nr = 1;
+	}
+	c->compress_workspaces_max = max;
+	spin_unlock(&c->compress_workspace_lock);
+
+	wake_up(&c->compress_workspace_wait);
+
+	return ws ? 0 : -ENOMEM;
+}
 
 int bch2_fs_compress_init(struct bch_fs *c)
 {
@@ -481,7 +748,8 @@ int bch2_fs_compress_init(struct bch_fs *c)
 	int ret;
 
 	if (!bch2_sb_test_feature(c->disk_sb, BCH_FEATURE_LZ4) &&
-	    !bch2_sb_test_feature(c->disk_sb, BCH_FEATURE_GZIP))
+	    !bch2_sb_test_feature(c->disk_sb, BCH_FEATURE_GZIP) &&
+	    !bch2_sb_test_feature(c->disk_sb, BCH_FEATURE_ZSTD))
 		return 0;
 
 	if (!mempool_initialized(&c->compression_bounce[READ])) {
@@ -498,19 +766,34 @@ int bch2_fs_compress_init(struct bch_fs *c)
 			return ret;
 	}
 
-	if (!mempool_initialized(&c->lz4_workspace_pool) &&
-	    bch2_sb_test_feature(c->disk_sb, BCH_FEATURE_LZ4)) {
-		ret = mempool_init_kmalloc_pool(&c->lz4_workspace_pool,
-						1, LZ4_MEM_COMPRESS);
-		if (ret)
-			return ret;
-	}
+	if (bch2_sb_test_feature(c->disk_sb, BCH_FEATURE_ZSTD))
+		c->zstd_params = ZSTD_getParams(c->opts.compression_level ?:
+						ZSTD_CLEVEL_DEFAULT,
+						c->sb.encoded_extent_max << 9, 0);
+
+	if (c->compress_workspaces) {
+		size_t size = compress_workspace_size(c);
+
+		if (size > c->compress_workspace_size)
+			return compress_workspaces_resize(c, size);
+	} else {
+		void *ws;
+
+		c->compress_workspace_size	= compress_workspace_size(c);
+		c->compress_workspaces_max	= num_possible_cpus();
 
-	if (!c->zlib_workspace &&
-	    bch2_sb_test_feature(c->disk_sb, BCH_FEATURE_GZIP)) {
-		c->zlib_workspace = vmalloc(COMPRESSION_WORKSPACE_SIZE);
-		if (!c->zlib_workspace)
+		c->compress_workspaces = kcalloc(c->compress_workspaces_max,
+						 sizeof(void *), GFP_KERNEL);
+		if (!c->compress_workspaces)
 			return -ENOMEM;
+
+		/* one is always preallocated, so we can make forward progress: */
+		ws = kvpmalloc(c->compress_workspace_size, GFP_KERNEL);
+		if (!ws)
+			return -ENOMEM;
+
+		c->compress_workspaces[c->compress_workspaces_free++] = ws;
+		c->compress_workspaces_nr = 1;
 	}
 
 	return 0;
@@ -47,9 +47,9 @@ static void sort_key_next(struct btree_node_iter *iter,
  */
 #define key_sort_cmp(h, l, r)						\
 ({									\
-	bkey_cmp_packed(b,						\
-			__btree_node_offset_to_key(b, (l).k),		\
-			__btree_node_offset_to_key(b, (r).k))		\
+	bkey_cmp_packed_inline(b,					\
+			       __btree_node_offset_to_key(b, (l).k),	\
+			       __btree_node_offset_to_key(b, (r).k))	\
 									\
 	?: (l).k - (r).k;						\
 })
@@ -75,9 +75,9 @@ static inline bool should_drop_next_key(struct btree_node_iter *iter,
 	 * comes first; so if l->k compares equal to r->k then l->k is older and
 	 * should be dropped.
 	 */
-	return !bkey_cmp_packed(b,
-				__btree_node_offset_to_key(b, l->k),
-				__btree_node_offset_to_key(b, r->k));
+	return !bkey_cmp_packed_inline(b,
+				       __btree_node_offset_to_key(b, l->k),
+				       __btree_node_offset_to_key(b, r->k));
 }
 
 struct btree_nr_keys bch2_key_sort_fix_overlapping(struct bset *dst,
@@ -89,7 +89,7 @@ struct btree_nr_keys bch2_key_sort_fix_overlapping(struct bset *dst,
 
 	memset(&nr, 0, sizeof(nr));
 
-	heap_resort(iter, key_sort_cmp);
+	heap_resort(iter, key_sort_cmp, NULL);
 
 	while (!bch2_btree_node_iter_end(iter)) {
 		if (!should_drop_next_key(iter, b)) {
@@ -102,7 +102,7 @@ struct btree_nr_keys bch2_key_sort_fix_overlapping(struct bset *dst,
 		}
 
 		sort_key_next(iter, b, iter->data);
-		heap_sift_down(iter, 0, key_sort_cmp);
+		heap_sift_down(iter, 0, key_sort_cmp, NULL);
 	}
 
 	dst->u64s = cpu_to_le16((u64 *) out - dst->_data);
@@ -893,7 +893,7 @@ static void extent_save(struct btree *b, struct btree_node_iter *iter,
 static inline void extent_sort_sift(struct btree_node_iter *iter,
 				    struct btree *b, size_t i)
 {
-	heap_sift_down(iter, i, extent_sort_cmp);
+	heap_sift_down(iter, i, extent_sort_cmp, NULL);
 }
 
 static inline void extent_sort_next(struct btree_node_iter *iter,
@@ -901,7 +901,7 @@ static inline void extent_sort_next(struct btree_node_iter *iter,
 				    struct btree_node_iter_set *i)
 {
 	sort_key_next(iter, b, i);
-	heap_sift_down(iter, i - iter->data, extent_sort_cmp);
+	heap_sift_down(iter, i - iter->data, extent_sort_cmp, NULL);
 }
 
 static void extent_sort_append(struct bch_fs *c,
@@ -949,7 +949,7 @@ struct btree_nr_keys bch2_extent_sort_fix_overlapping(struct bch_fs *c,
 
 	memset(&nr, 0, sizeof(nr));
 
-	heap_resort(iter, extent_sort_cmp);
+	heap_resort(iter, extent_sort_cmp, NULL);
 
 	while (!bch2_btree_node_iter_end(iter)) {
 		lk = __btree_node_offset_to_key(b, _l->k);
@@ -1965,6 +1965,25 @@ void bch2_extent_crc_append(struct bkey_i_extent *e,
 	__extent_entry_push(e);
 }
 
+/*
+ * Fill in the checksum of a crc entry that was appended before the checksum was
+ * known (the write path computes checksums in parallel) - the checksum doesn't
+ * affect which crc format was picked, so this can be done in place:
+ */
+void bch2_extent_crc_set_csum(struct bkey_i_extent *e, struct bch_csum csum)
+{
+	union bch_extent_entry *entry;
+
+	extent_for_each_entry(extent_i_to_s(e), entry)
+		if (extent_entry_is_crc(entry)) {
+			struct bch_extent_crc_unpacked crc =
+				bch2_extent_crc_unpack(&e->k, entry_to_crc(entry));
+
+			crc.csum = csum;
+			bch2_extent_crc_init(entry_to_crc(entry), crc);
+		}
+}
+
 /*
  * bch_extent_normalize - clean up an extent, dropping stale pointers etc.
  *
@@ -388,6 +388,7 @@ out:									\
 
 void bch2_extent_crc_append(struct bkey_i_extent *,
 			    struct bch_extent_crc_unpacked);
+void bch2_extent_crc_set_csum(struct bkey_i_extent *, struct bch_csum);
 
 static inline void __extent_entry_push(struct bkey_i_extent *e)
 {
@@ -538,6 +538,64 @@ static enum prep_encoded_ret {
 	return PREP_ENCODED_OK;
 }
 
+/*
+ * When a write is split into multiple checksummed extents, all but the last
+ * extent are encrypted/checksummed on c->crypt_wq while we keep building
+ * keys; the checksums are filled into the keys before the write is submitted:
+ */
+#define BCH_WRITE_CSUM_ASYNC_MAX	16
+
+struct bch_write_csum {
+	struct closure		cl;
+	struct bch_fs		*c;
+	struct bio		*bio;
+	struct bvec_iter	iter;
+	struct nonce		nonce;
+	unsigned		csum_type;
+	unsigned		key_offset;	/* in op->insert_keys */
+	struct bch_csum		csum;
+};
+
+static void bch2_write_csum_fn(struct closure *cl)
+{
+	struct bch_write_csum *w = container_of(cl, struct bch_write_csum, cl);
+	struct bvec_iter iter = w->iter;
+
+	__bch2_encrypt_bio(w->c, w->csum_type, w->nonce, w->bio, w->iter);
+	w->csum = __bch2_checksum_bio(w->c, w->csum_type, w->nonce,
+				      w->bio, &iter);
+	closure_return(cl);
+}
+
+static void bch2_write_csums_done(struct bch_write_op *op,
+				  struct closure *cl,
+				  struct bch_write_csum *w, unsigned nr)
+{
+	closure_sync(cl);
+
+	while (nr--)
+		bch2_extent_crc_set_csum(bkey_i_to_extent((void *)
+				(op->insert_keys.keys_p + w[nr].key_offset)),
+				w[nr].csum);
+}
+
+/*
+ * Uncompressed checksummed extents are limited to csum_granularity, so that
+ * small reads don't have to read and checksum a much bigger extent:
+ */
+static unsigned write_csum_max_sectors(struct bch_fs *c,
+				       struct bch_write_op *op)
+{
+	unsigned sectors = c->sb.encoded_extent_max;
+
+	if (op->csum_granularity)
+		sectors = clamp_t(unsigned,
+				  round_down(op->csum_granularity,
+					     c->opts.block_size),
+				  c->opts.block_size, sectors);
+	return sectors;
+}
+
 static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp)
 {
 	struct bch_fs *c = op->c;
@@ -547,11 +605,16 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp)
 	unsigned key_to_write_offset = op->insert_keys.top_p -
 		op->insert_keys.keys_p;
 	unsigned total_output = 0;
+	struct bch_write_csum csums[BCH_WRITE_CSUM_ASYNC_MAX];
+	struct closure csum_cl;
+	unsigned nr_csums = 0;
 	bool bounce = false, page_alloc_failed = false;
 	int ret, more = 0;
 
 	BUG_ON(!bio_sectors(src));
 
+	closure_init_stack(&csum_cl);
+
 	switch (bch2_write_prep_encoded_data(op, wp)) {
 	case PREP_ENCODED_OK:
 		break;
@@ -602,7 +665,7 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp)
 
 			if (op->csum_type)
 				dst_len = min_t(unsigned, dst_len,
-						c->sb.encoded_extent_max << 9);
+						write_csum_max_sectors(c, op) << 9);
 
 			if (bounce) {
 				swap(dst->bi_iter.bi_size, dst_len);
@@ -659,13 +722,35 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp)
 			crc.uncompressed_size	= src_len >> 9;
 			crc.live_size		= src_len >> 9;
 
-			swap(dst->bi_iter.bi_size, dst_len);
-			bch2_encrypt_bio(c, op->csum_type,
-					 extent_nonce(version, crc), dst);
-			crc.csum = bch2_checksum_bio(c, op->csum_type,
-					 extent_nonce(version, crc), dst);
-			crc.csum_type = op->csum_type;
-			swap(dst->bi_iter.bi_size, dst_len);
+			crc.csum_type		= op->csum_type;
+
+			if (op->csum_type &&
+			    !(op->flags & BCH_WRITE_DATA_ENCODED) &&
+			    !crypt_parallel_disabled(c) &&
+			    nr_csums < ARRAY_SIZE(csums) &&
+			    dst_len < dst->bi_iter.bi_size &&
+			    src_len < src->bi_iter.bi_size) {
+				struct bch_write_csum *w = &csums[nr_csums++];
+
+				w->c		= c;
+				w->bio		= dst;
+				w->iter		= dst->bi_iter;
+				w->iter.bi_size	= dst_len;
+				w->nonce	= extent_nonce(version, crc);
+				w->csum_type	= op->csum_type;
+				w->key_offset	= op->insert_keys.top_p -
+					op->insert_keys.keys_p;
+
+				closure_call(&w->cl, bch2_write_csum_fn,
+					     c->crypt_wq, &csum_cl);
+			} else {
+				swap(dst->bi_iter.bi_size, dst_len);
+				bch2_encrypt_bio(c, op->csum_type,
+						 extent_nonce(version, crc), dst);
+				crc.csum = bch2_checksum_bio(c, op->csum_type,
+						 extent_nonce(version, crc), dst);
+				swap(dst->bi_iter.bi_size, dst_len);
+			}
 		}
 
 		init_append_extent(op, wp, version, crc);
@@ -682,6 +767,8 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp)
 				      ARRAY_SIZE(op->inline_keys),
 				      BKEY_EXTENT_U64s_MAX));
 
+	bch2_write_csums_done(op, &csum_cl, csums, nr_csums);
+
 	more = src->bi_iter.bi_size != 0;
 
 	dst->bi_iter = saved_iter;
@@ -914,6 +1001,7 @@ static void promote_start(struct promote_op *op, struct bch_read_bio *rbio)
 	op->write.op.csum_type = bch2_data_checksum_type(c, rbio->opts.data_checksum);
 	op->write.op.compression_type =
 		bch2_compression_opt_to_type(rbio->opts.compression);
+	op->write.op.csum_granularity = rbio->opts.checksum_granularity;
 
 	op->write.move_dev	= -1;
 	op->write.op.devs	= c->fastest_devs;
@@ -1007,6 +1095,37 @@ static void bch2_rbio_punt(struct bch_read_bio *rbio, work_func_t fn,
 	}
 }
 
+/*
+ * Compressed extents are read into a single contiguous allocation when
+ * possible, so that they can be decompressed directly from the read buffer:
+ */
+static bool rbio_alloc_pages_contig(struct bio *bio, size_t bytes)
+{
+	struct page *page = alloc_pages(GFP_NOIO|__GFP_NOWARN, get_order(bytes));
+	unsigned i;
+
+	if (!page)
+		return false;
+
+	for (i = 0; i < DIV_ROUND_UP(bytes, PAGE_SIZE); i++) {
+		struct bio_vec *bv = &bio->bi_io_vec[bio->bi_vcnt++];
+
+		bv->bv_page	= virt_to_page(page_address(page) + i * PAGE_SIZE);
+		bv->bv_len	= PAGE_SIZE;
+		bv->bv_offset	= 0;
+	}
+
+	bio->bi_iter.bi_size = bytes;
+	return true;
+}
+
+static void rbio_free_pages_contig(struct bio *bio)
+{
+	__free_pages(bio->bi_io_vec[0].bv_page,
+		     get_order(bio->bi_vcnt << PAGE_SHIFT));
+	bio->bi_vcnt = 0;
+}
+
 static inline struct bch_read_bio *bch2_rbio_free(struct bch_read_bio *rbio)
 {
 	struct bch_read_bio *parent = rbio->parent;
@@ -1015,7 +1134,9 @@ static inline struct bch_read_bio *bch2_rbio_free(struct bch_read_bio *rbio)
 
 	if (rbio->promote)
 		kfree(rbio->promote);
-	if (rbio->bounce)
+	if (rbio->bounce_contig)
+		rbio_free_pages_contig(&rbio->bio);
+	else if (rbio->bounce)
 		bch2_bio_free_pages_pool(rbio->c, &rbio->bio);
 	bio_put(&rbio->bio);
 
@@ -1300,8 +1421,8 @@ int __bch2_read_extent(struct bch_fs *c, struct bch_read_bio *orig,
 		       struct extent_pick_ptr *pick, unsigned flags)
 {
 	struct bch_read_bio *rbio;
-	bool split = false, bounce = false, read_full = false;
-	bool promote = false, narrow_crcs = false;
+	bool split = false, bounce = false, bounce_contig = false;
+	bool read_full = false, promote = false, narrow_crcs = false;
 	struct bpos pos = bkey_start_pos(e.k);
 	int ret = 0;
 
@@ -1364,7 +1485,12 @@ int __bch2_read_extent(struct bch_fs *c, struct bch_read_bio *orig,
 					&c->bio_read_split),
 				 orig->opts);
 
-		bch2_bio_alloc_pages_pool(c, &rbio->bio, sectors << 9);
+		/* promote takes ownership of the pages, and frees them singly: */
+		bounce_contig = pick->crc.compression_type &&
+			!promote &&
+			rbio_alloc_pages_contig(&rbio->bio, sectors << 9);
+		if (!bounce_contig)
+			bch2_bio_alloc_pages_pool(c, &rbio->bio, sectors << 9);
 		split = true;
 	} else if (flags & BCH_READ_MUST_CLONE) {
 		/*
@@ -1399,6 +1525,7 @@ noclone:
 	rbio->submit_time_us	= local_clock_us();
 	rbio->flags		= flags;
 	rbio->bounce		= bounce;
+	rbio->bounce_contig	= bounce_contig;
 	rbio->split		= split;
 	rbio->narrow_crcs	= narrow_crcs;
 	rbio->retry		= 0;
@@ -40,6 +40,7 @@ struct bch_read_bio {
 	union {
 	struct {
 	u8			bounce:1,
+				bounce_contig:1,
 				split:1,
 				narrow_crcs:1,
 				retry:2,
@@ -99,6 +100,8 @@ struct bch_write_op {
 	unsigned		alloc_reserve:4;
 
 	u8			open_buckets_nr;
+	/* max sectors per uncompressed checksummed extent, 0 for default: */
+	u8			csum_granularity;
 	struct bch_devs_list	devs_have;
 	u16			target;
 	u16			nonce;
@@ -13,7 +13,8 @@
 #include "move.h"
 #include "super-io.h"
 
-static bool migrate_pred(void *arg, struct bkey_s_c_extent e)
+static bool migrate_pred(void *arg, struct bkey_s_c_extent e,
+			 struct bch_io_opts *io_opts)
 {
 	struct bch_dev *ca = arg;
 
@@ -87,6 +87,16 @@ static int bch2_migrate_index_update(struct bch_write_op *op)
 					    m->move_dev)))
 			bch2_extent_drop_ptr(extent_i_to_s(insert), ptr);
 
+		if (m->move_dev == MOVE_REWRITE) {
+			/* don't lose redundancy if some of the writes failed: */
+			if (bch2_extent_nr_ptrs(extent_i_to_s_c(new)) <
+			    min_t(unsigned, c->opts.data_replicas,
+				  bch2_extent_nr_dirty_ptrs(bkey_i_to_s_c(&insert->k_i))))
+				goto nomatch;
+
+			set_bkey_val_u64s(&insert->k, 0);
+		}
+
 		extent_for_each_ptr_crc(extent_i_to_s(new), ptr, crc) {
 			if (bch2_extent_has_device(extent_i_to_s_c(insert), ptr->dev)) {
 				/*
@@ -183,6 +193,13 @@ void bch2_migrate_write_init(struct migrate_write *m,
 	m->op.wbio.bio.bi_iter.bi_size = m->op.crc.compressed_size << 9;
 	m->op.nr_replicas	= 1;
 	m->op.nr_replicas_required = 1;
+
+	if (m->move_dev == MOVE_REWRITE) {
+		/* existing pointers are all being replaced: */
+		m->op.devs_have.nr	= 0;
+		m->op.nr_replicas	= m->op.c->opts.data_replicas;
+		m->op.nr_replicas_required = m->op.nr_replicas;
+	}
 	m->op.index_update_fn	= bch2_migrate_index_update;
 }
 
@@ -295,6 +312,7 @@ static int bch2_move_extent(struct bch_fs *c,
 	io->write.op.csum_type = bch2_data_checksum_type(c, opts.data_checksum);
 	io->write.op.compression_type =
 		bch2_compression_opt_to_type(opts.compression);
+	io->write.op.csum_granularity = opts.checksum_granularity;
 	io->write.op.devs	= devs;
 	io->write.op.write_point = wp;
 
@@ -379,9 +397,11 @@ int bch2_move_data(struct bch_fs *c,
 	bool kthread = (current->flags & PF_KTHREAD) != 0;
 	struct moving_context ctxt = { .stats = stats };
 	struct bch_io_opts opts = bch2_opts_to_inode_opts(c->opts);
+	struct bch_io_opts io_opts;
 	BKEY_PADDED(k) tmp;
 	struct bkey_s_c k;
 	struct bkey_s_c_extent e;
+	struct blk_plug plug;
 	u64 cur_inum = U64_MAX;
 	int ret = 0;
 
@@ -396,6 +416,8 @@ int bch2_move_data(struct bch_fs *c,
 	if (rate)
 		bch2_ratelimit_reset(rate);
 
+	blk_start_plug(&plug);
+
 	while (!kthread || !(ret = kthread_should_stop())) {
 		if (atomic_read(&ctxt.sectors_in_flight) >= sectors_in_flight) {
 			bch2_btree_iter_unlock(&stats->iter);
@@ -437,7 +459,8 @@ peek:
 			goto peek;
 		}
 
-		if (!pred(arg, e))
+		io_opts = opts;
+		if (!pred(arg, e, &io_opts))
 			goto next;
 
 		/* unlock before doing IO: */
@@ -447,7 +470,7 @@ peek:
 
 		if (bch2_move_extent(c, &ctxt, devs, wp,
 				     btree_insert_flags,
-				     move_device, opts,
+				     move_device, io_opts,
 				     bkey_s_c_to_extent(k))) {
 			/* memory allocation failure, wait for some IO to finish */
 			bch2_move_ctxt_wait_for_io(&ctxt);
@@ -464,6 +487,8 @@ next_nondata:
 		bch2_btree_iter_cond_resched(&stats->iter);
 	}
 
+	blk_finish_plug(&plug);
+
 	bch2_btree_iter_unlock(&stats->iter);
 
 	move_ctxt_wait_event(&ctxt, !atomic_read(&ctxt.sectors_in_flight));
@@ -542,7 +567,7 @@ static int bch2_move_btree(struct bch_fs *c,
 
 	for (id = 0; id < BTREE_ID_NR; id++) {
 		for_each_btree_node(&stats->iter, c, id, POS_MIN, BTREE_ITER_PREFETCH, b) {
-			if (pred(arg, bkey_i_to_s_c_extent(&b->key)))
+			if (pred(arg, bkey_i_to_s_c_extent(&b->key), NULL))
 				ret = bch2_btree_node_rewrite(c, &stats->iter,
 						b->data->keys.seq, 0) ?: ret;
 
@@ -556,12 +581,14 @@ static int bch2_move_btree(struct bch_fs *c,
 }
 
 #if 0
-static bool scrub_data_pred(void *arg, struct bkey_s_c_extent e)
+static bool scrub_data_pred(void *arg, struct bkey_s_c_extent e,
+			    struct bch_io_opts *io_opts)
 {
 }
 #endif
 
-static bool rereplicate_metadata_pred(void *arg, struct bkey_s_c_extent e)
+static bool rereplicate_metadata_pred(void *arg, struct bkey_s_c_extent e,
+				      struct bch_io_opts *io_opts)
 {
 	struct bch_fs *c = arg;
 	unsigned nr_good = bch2_extent_nr_good_ptrs(c, e);
@@ -569,7 +596,8 @@ static bool rereplicate_metadata_pred(void *arg, struct bkey_s_c_extent e)
 	return nr_good && nr_good < c->opts.metadata_replicas;
 }
 
-static bool rereplicate_data_pred(void *arg, struct bkey_s_c_extent e)
+static bool rereplicate_data_pred(void *arg, struct bkey_s_c_extent e,
+				  struct bch_io_opts *io_opts)
 {
 	struct bch_fs *c = arg;
 	unsigned nr_good = bch2_extent_nr_good_ptrs(c, e);
@@ -577,13 +605,32 @@ static bool rereplicate_data_pred(void *arg, struct bkey_s_c_extent e)
 	return nr_good && nr_good < c->opts.data_replicas;
 }
 
-static bool migrate_pred(void *arg, struct bkey_s_c_extent e)
+static bool migrate_pred(void *arg, struct bkey_s_c_extent e,
+			 struct bch_io_opts *io_opts)
 {
 	struct bch_ioctl_data *op = arg;
 
 	return bch2_extent_has_device(e, op->migrate.dev);
 }
 
+static bool recompress_pred(void *arg, struct bkey_s_c_extent e,
+			    struct bch_io_opts *io_opts)
+{
+	struct bch_fs *c = arg;
+	unsigned type = bch2_compression_opt_to_type(
+				c->opts.background_compression);
+	const struct bch_extent_ptr *ptr;
+	struct bch_extent_crc_unpacked crc;
+
+	extent_for_each_ptr_crc(e, ptr, crc)
+		if (!ptr->cached && crc.compression_type != type) {
+			io_opts->compression = c->opts.background_compression;
+			return true;
+		}
+
+	return false;
+}
+
 int bch2_data_job(struct bch_fs *c,
 		  struct bch_move_stats *stats,
 		  struct bch_ioctl_data op)
@@ -626,6 +673,20 @@ int bch2_data_job(struct bch_fs *c,
 				     migrate_pred, &op, stats) ?: ret;
 		ret = bch2_gc_data_replicas(c) ?: ret;
 		break;
+	case BCH_DATA_OP_RECOMPRESS:
+		if (!c->opts.background_compression)
+			return -EINVAL;
+
+		ret = bch2_move_data(c, &c->recompress_rate,
+				     SECTORS_IN_FLIGHT_PER_DEVICE,
+				     NULL,
+				     writepoint_hashed((unsigned long) current),
+				     0, MOVE_REWRITE,
+				     op.start,
+				     op.end,
+				     recompress_pred, c, stats);
+		ret = bch2_gc_data_replicas(c) ?: ret;
+		break;
 	default:
 		ret = -EINVAL;
 	}
@@ -15,16 +15,20 @@ struct migrate_write {
 	struct bch_extent_ptr	ptr;
 	u64			offset;
 
-	int			move_dev;
+	int			move_dev;	/* -1, device index or MOVE_REWRITE */
 	int			btree_insert_flags;
 	struct bch_write_op	op;
 };
 
+/* write new copies of the data and drop all of the existing pointers: */
+#define MOVE_REWRITE		-2
+
 void bch2_migrate_write_init(struct migrate_write *, struct bch_read_bio *);
 
 #define SECTORS_IN_FLIGHT_PER_DEVICE	2048
 
-typedef bool (*move_pred_fn)(void *, struct bkey_s_c_extent);
+typedef bool (*move_pred_fn)(void *, struct bkey_s_c_extent,
+			     struct bch_io_opts *);
 
 struct bch_move_stats {
 	enum bch_data_type	data_type;
@@ -61,7 +61,8 @@ static int bucket_offset_cmp(const void *_l, const void *_r, size_t size)
 	return (l->offset > r->offset) - (l->offset < r->offset);
 }
 
-static bool copygc_pred(void *arg, struct bkey_s_c_extent e)
+static bool copygc_pred(void *arg, struct bkey_s_c_extent e,
+			struct bch_io_opts *io_opts)
 {
 	struct bch_dev *ca = arg;
 	copygc_heap *h = &ca->copygc_heap;
@@ -139,7 +140,7 @@ static void bch2_copygc(struct bch_fs *c, struct bch_dev *ca)
 			.offset = bucket_to_sector(ca, b),
 			.mark	= m
 		};
-		heap_add_or_replace(h, e, -sectors_used_cmp);
+		heap_add_or_replace(h, e, -sectors_used_cmp, NULL);
 	}
 	up_read(&ca->bucket_lock);
 	up_read(&c->gc_lock);
@@ -148,7 +149,7 @@ static void bch2_copygc(struct bch_fs *c, struct bch_dev *ca)
 		sectors_to_move += bucket_sectors_used(i->mark);
 
 	while (sectors_to_move > COPYGC_SECTORS_PER_ITER(ca)) {
-		BUG_ON(!heap_pop(h, e, -sectors_used_cmp));
+		BUG_ON(!heap_pop(h, e, -sectors_used_cmp, NULL));
 		sectors_to_move -= bucket_sectors_used(e.mark);
 	}
 
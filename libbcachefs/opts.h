@@ -91,9 +91,18 @@ enum opt_type {
 	BCH_OPT(data_checksum,		u8,	OPT_RUNTIME,		\
 		OPT_STR(bch2_csum_types),				\
 		BCH_SB_DATA_CSUM_TYPE,		BCH_CSUM_OPT_CRC32C)	\
+	BCH_OPT(checksum_granularity,	u8,	OPT_RUNTIME,		\
+		OPT_UINT(0, 255),					\
+		BCH_SB_CHECKSUM_GRANULARITY,	0)			\
 	BCH_OPT(compression,		u8,	OPT_RUNTIME,		\
 		OPT_STR(bch2_compression_types),			\
 		BCH_SB_COMPRESSION_TYPE,	BCH_COMPRESSION_OPT_NONE)\
+	BCH_OPT(compression_level,	u8,	OPT_MOUNT,		\
+		OPT_UINT(0, 23),					\
+		BCH_SB_COMPRESSION_LEVEL,	0)			\
+	BCH_OPT(background_compression,	u8,	OPT_RUNTIME,		\
+		OPT_STR(bch2_compression_types),			\
+		BCH_SB_BACKGROUND_COMPRESSION_TYPE, BCH_COMPRESSION_OPT_NONE)\
 	BCH_OPT(str_hash,		u8,	OPT_RUNTIME,		\
 		OPT_STR(bch2_str_hash_types),				\
 		BCH_SB_STR_HASH_TYPE,		BCH_STR_HASH_SIPHASH)	\
@@ -235,7 +244,8 @@ int bch2_parse_mount_opts(struct bch_opts *, char *);
 
 #define BCH_INODE_OPTS()					\
 	BCH_INODE_OPT(data_checksum,			8)	\
-	BCH_INODE_OPT(compression,			8)
+	BCH_INODE_OPT(compression,			8)	\
+	BCH_INODE_OPT(checksum_granularity,		8)
 
 struct bch_io_opts {
 #define BCH_INODE_OPT(_name, _bits)	unsigned _name##_defined:1;
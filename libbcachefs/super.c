@@ -414,6 +414,7 @@ static void bch2_fs_free(struct bch_fs *c)
 	bch2_io_clock_exit(&c->io_clock[READ]);
 	bch2_fs_compress_exit(c);
 	lg_lock_free(&c->usage_lock);
+	free_percpu(c->btree_insert_stats);
 	free_percpu(c->usage_percpu);
 	mempool_exit(&c->btree_bounce_pool);
 	mempool_exit(&c->bio_bounce_pages);
@@ -539,7 +540,8 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	mutex_init(&c->btree_interior_update_lock);
 
 	mutex_init(&c->bio_bounce_pages_lock);
-	mutex_init(&c->zlib_workspace_lock);
+	spin_lock_init(&c->compress_workspace_lock);
+	init_waitqueue_head(&c->compress_workspace_wait);
 
 	bio_list_init(&c->btree_write_error_list);
 	spin_lock_init(&c->btree_write_error_lock);
@@ -556,6 +558,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	c->copy_gc_enabled = 1;
 	c->tiering_enabled = 1;
 	c->tiering_percent = 10;
+	c->recompress_rate.rate = 1 << 14;
 
 	c->journal.write_time	= &c->journal_write_time;
 	c->journal.delay_time	= &c->journal_delay_time;
@@ -617,6 +620,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 					 c->sb.encoded_extent_max) /
 				   PAGE_SECTORS, 0) ||
 	    !(c->usage_percpu = alloc_percpu(struct bch_fs_usage)) ||
+	    !(c->btree_insert_stats = alloc_percpu(struct btree_insert_stats)) ||
 	    lg_lock_init(&c->usage_lock) ||
 	    mempool_init_vp_pool(&c->btree_bounce_pool, 1, btree_bytes(c)) ||
 	    bch2_io_clock_init(&c->io_clock[READ]) ||
@@ -626,6 +630,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	    bch2_fs_encryption_init(c) ||
 	    bch2_fs_compress_init(c) ||
 	    bch2_check_set_has_compressed_data(c, c->opts.compression) ||
+	    bch2_check_set_has_compressed_data(c, c->opts.background_compression) ||
 	    bch2_fs_fsio_init(c))
 		goto err;
 
@@ -160,6 +160,15 @@ write_attribute(wake_allocator);
 read_attribute(read_realloc_races);
 read_attribute(extent_migrate_done);
 read_attribute(extent_migrate_raced);
+read_attribute(compress_skipped);
+read_attribute(compress_skip_audits);
+read_attribute(compress_skip_wrong);
+read_attribute(compress_wasted);
+read_attribute(compress_workspace_hits);
+read_attribute(compress_workspace_misses);
+read_attribute(compress_workspace_waits);
+read_attribute(btree_insert_appends);
+read_attribute(btree_insert_searches);
 
 rw_attribute(journal_write_delay_ms);
 rw_attribute(journal_reclaim_delay_ms);
@@ -175,6 +184,7 @@ rw_attribute(tiering_enabled);
 rw_attribute(tiering_percent);
 sysfs_pd_controller_attribute(tiering);
 
+rw_attribute(recompress_rate);
 
 rw_attribute(pd_controllers_update_seconds);
 
@@ -300,6 +310,20 @@ static ssize_t bch2_compression_stats(struct bch_fs *c, char *buf)
 			compressed_sectors_uncompressed << 9);
 }
 
+static struct btree_insert_stats bch2_btree_insert_stats(struct bch_fs *c)
+{
+	struct btree_insert_stats ret = { 0 }, *s;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(c->btree_insert_stats, cpu);
+		ret.appends	+= s->appends;
+		ret.searches	+= s->searches;
+	}
+
+	return ret;
+}
+
 SHOW(bch2_fs)
 {
 	struct bch_fs *c = container_of(kobj, struct bch_fs, kobj);
@@ -320,6 +344,24 @@ SHOW(bch2_fs)
 		    atomic_long_read(&c->extent_migrate_done));
 	sysfs_print(extent_migrate_raced,
 		    atomic_long_read(&c->extent_migrate_raced));
+	sysfs_print(compress_skipped,
+		    atomic_long_read(&c->compress_skipped));
+	sysfs_print(compress_skip_audits,
+		    atomic_long_read(&c->compress_skip_audits));
+	sysfs_print(compress_skip_wrong,
+		    atomic_long_read(&c->compress_skip_wrong));
+	sysfs_print(compress_wasted,
+		    atomic_long_read(&c->compress_wasted));
+	sysfs_print(compress_workspace_hits,
+		    atomic_long_read(&c->compress_workspace_hits));
+	sysfs_print(compress_workspace_misses,
+		    atomic_long_read(&c->compress_workspace_misses));
+	sysfs_print(compress_workspace_waits,
+		    atomic_long_read(&c->compress_workspace_waits));
+	sysfs_print(btree_insert_appends,
+		    bch2_btree_insert_stats(c).appends);
+	sysfs_print(btree_insert_searches,
+		    bch2_btree_insert_stats(c).searches);
 
 	sysfs_printf(btree_gc_periodic, "%u",	(int) c->btree_gc_periodic);
 
@@ -333,6 +375,8 @@ SHOW(bch2_fs)
 
 	sysfs_pd_controller_show(tiering,	&c->tiers[1].pd); /* XXX */
 
+	sysfs_print(recompress_rate,		c->recompress_rate.rate);
+
 	sysfs_printf(meta_replicas_have, "%u",	bch2_replicas_online(c, true));
 	sysfs_printf(data_replicas_have, "%u",	bch2_replicas_online(c, false));
 
@@ -404,6 +448,9 @@ STORE(__bch2_fs)
 	sysfs_strtoul(tiering_percent,		c->tiering_percent);
 	sysfs_pd_controller_store(tiering,	&c->tiers[1].pd); /* XXX */
 
+	sysfs_strtoul_clamp(recompress_rate,
+			    c->recompress_rate.rate, 1, UINT_MAX);
+
 	/* Debugging: */
 
 #define BCH_DEBUG_PARAM(name, description) sysfs_strtoul(name, c->name);
@@ -460,6 +507,7 @@ struct attribute *bch2_fs_files[] = {
 	&sysfs_journal_reclaim_delay_ms,
 
 	&sysfs_tiering_percent,
+	&sysfs_recompress_rate,
 
 	&sysfs_compression_stats,
 	NULL
@@ -490,6 +538,15 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_read_realloc_races,
 	&sysfs_extent_migrate_done,
 	&sysfs_extent_migrate_raced,
+	&sysfs_compress_skipped,
+	&sysfs_compress_skip_audits,
+	&sysfs_compress_skip_wrong,
+	&sysfs_compress_wasted,
+	&sysfs_compress_workspace_hits,
+	&sysfs_compress_workspace_misses,
+	&sysfs_compress_workspace_waits,
+	&sysfs_btree_insert_appends,
+	&sysfs_btree_insert_searches,
 
 	&sysfs_trigger_journal_flush,
 	&sysfs_trigger_btree_coalesce,
@@ -539,7 +596,8 @@ STORE(bch2_fs_opts_dir)
 
 	mutex_lock(&c->sb_lock);
 
-	if (id == Opt_compression) {
+	if (id == Opt_compression ||
+	    id == Opt_background_compression) {
 		int ret = bch2_check_set_has_compressed_data(c, v);
 		if (ret) {
 			mutex_unlock(&c->sb_lock);
@@ -14,7 +14,8 @@
 #include <linux/kthread.h>
 #include <trace/events/bcachefs.h>
 
-static bool tiering_pred(void *arg, struct bkey_s_c_extent e)
+static bool tiering_pred(void *arg, struct bkey_s_c_extent e,
+			 struct bch_io_opts *io_opts)
 {
 	struct bch_tier *tier = arg;
 	struct bch_fs *c = container_of(tier, struct bch_fs, tiers[tier->idx]);
@@ -30,7 +31,13 @@ static bool tiering_pred(void *arg, struct bkey_s_c_extent e)
 		if (bch_dev_bkey_exists(c, ptr->dev)->mi.tier >= tier->idx)
 			replicas++;
 
-	return replicas < c->opts.data_replicas;
+	if (replicas >= c->opts.data_replicas)
+		return false;
+
+	/* data moving to a slower tier is cold, use the stronger compression: */
+	if (c->opts.background_compression)
+		io_opts->compression = c->opts.background_compression;
+	return true;
 }
 
 static int bch2_tiering_thread(void *arg)
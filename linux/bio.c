@@ -194,11 +194,28 @@ void bio_advance(struct bio *bio, unsigned bytes)
 	bio_advance_iter(bio, &bio->bi_iter, bytes);
 }
 
+/*
+ * Bios with up to BIO_INLINE_VECS biovecs come from the bioset's mempool,
+ * bigger ones from kmalloc:
+ */
+#define BIO_INLINE_VECS		4
+
+static bool bio_from_pool(struct bio_set *bs, unsigned nr_iovecs)
+{
+	return bs &&
+		mempool_initialized(&bs->bio_pool) &&
+		nr_iovecs <= BIO_INLINE_VECS;
+}
+
 static void bio_free(struct bio *bio)
 {
-	unsigned front_pad = bio->bi_pool ? bio->bi_pool->front_pad : 0;
+	struct bio_set *bs = bio->bi_pool;
+	unsigned front_pad = bs ? bs->front_pad : 0;
 
-	kfree((void *) bio - front_pad);
+	if (bio_from_pool(bs, bio->bi_max_vecs))
+		mempool_free((void *) bio - front_pad, &bs->bio_pool);
+	else
+		kfree((void *) bio - front_pad);
 }
 
 void bio_put(struct bio *bio)
@@ -288,10 +305,15 @@ struct bio *bio_alloc_bioset(gfp_t gfp_mask, int nr_iovecs, struct bio_set *bs)
 	struct bio *bio;
 	void *p;
 
-	p = kmalloc(front_pad +
-		    sizeof(struct bio) +
-		    nr_iovecs * sizeof(struct bio_vec),
-		    gfp_mask);
+	if (bio_from_pool(bs, nr_iovecs)) {
+		nr_iovecs = BIO_INLINE_VECS;
+		p = mempool_alloc(&bs->bio_pool, gfp_mask);
+	} else {
+		p = kmalloc(front_pad +
+			    sizeof(struct bio) +
+			    nr_iovecs * sizeof(struct bio_vec),
+			    gfp_mask);
+	}
 
 	if (unlikely(!p))
 		return NULL;
@@ -334,3 +356,30 @@ struct bio *bio_clone_bioset(struct bio *bio_src, gfp_t gfp_mask,
 
 	return bio;
 }
+
+void bioset_exit(struct bio_set *bs)
+{
+	mempool_exit(&bs->bio_pool);
+	kmem_cache_destroy(bs->bio_slab);
+	bs->bio_slab = NULL;
+}
+
+int bioset_init(struct bio_set *bs,
+		unsigned int pool_size,
+		unsigned int front_pad,
+		int flags)
+{
+	bs->front_pad = front_pad;
+
+	bs->bio_slab = kmem_cache_create("bio", front_pad +
+					 sizeof(struct bio) +
+					 BIO_INLINE_VECS * sizeof(struct bio_vec),
+					 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!bs->bio_slab ||
+	    mempool_init_slab_pool(&bs->bio_pool, pool_size, bs->bio_slab)) {
+		bioset_exit(bs);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
@@ -1,93 +1,562 @@
 
-#include <alloca.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
 #include <libaio.h>
 
+/* normally pulled in by <linux/types.h>, which include/linux shadows: */
+#include <linux/posix_types.h>
+#include <linux/stddef.h>
+#include <linux/io_uring.h>
+
 #include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/completion.h>
 #include <linux/fs.h>
 #include <linux/kthread.h>
+#include <linux/semaphore.h>
+#include <linux/sort.h>
 
 #include "tools-util.h"
 
-static io_context_t aio_ctx;
+/*
+ * Two backends: io_uring, and the older libaio path. io_uring is used when
+ * the running kernel supports it; BCACHEFS_IO_ENGINE=aio or =io_uring in the
+ * environment picks one explicitly.
+ *
+ * Each block device gets its own submission context, BCACHEFS_IO_DEPTH
+ * entries deep, and its own thread reaping completions; bios are then ended
+ * by a shared pool of BCACHEFS_IO_COMPLETION_THREADS threads (at least one).
+ *
+ * Submitters sleep when the ring is full, until the reaper frees up space: so
+ * the reaper must never end bios itself, since endio may submit more IO.
+ */
+enum blkdev_io_engine {
+	BLKDEV_IO_AIO,
+	BLKDEV_IO_URING,
+};
+
+static enum blkdev_io_engine io_engine;
+static unsigned io_depth = 256;
+
+/* user_data tag for the fsync that precedes a REQ_PREFLUSH write: */
+#define URING_PREFLUSH		1UL
+
+struct uring_slot {
+	struct iovec		*iov;
+	unsigned		nr_iov;
+};
+
+struct uring {
+	int			fd;
+
+	struct mutex		sq_lock;
+	unsigned		sq_tail;
+	unsigned		sq_pending;
+	unsigned		*sq_khead;
+	unsigned		*sq_ktail;
+	unsigned		sq_mask;
+	unsigned		*sq_array;
+	struct io_uring_sqe	*sqes;
+	struct uring_slot	*slots;
+
+	unsigned		*cq_khead;
+	unsigned		*cq_ktail;
+	unsigned		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	/* bounds SQEs in flight to what the CQ ring can hold: */
+	struct semaphore	cq_space;
+
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	unsigned		nr_sqes;
+};
+
+struct blkdev_ioctx {
+	struct task_struct	*reaper;
+
+	io_context_t		aio_ctx;
+	/* bounds iocbs in flight to what the aio ring can hold: */
+	struct semaphore	aio_space;
+	struct uring		uring;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	struct bio_list		bios;
+	unsigned		nr_threads;
+} endio_pool = {
+	.lock			= PTHREAD_MUTEX_INITIALIZER,
+	.wait			= PTHREAD_COND_INITIALIZER,
+	.bios			= BIO_EMPTY_LIST,
+	.nr_threads		= 4,
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
 
-void generic_make_request(struct bio *bio)
+static int io_uring_enter(int fd, unsigned to_submit,
+			  unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+/*
+ * A request is a chain of bios linked through bi_next, covering contiguous
+ * sectors: it's only more than one bio when bios were merged while plugged.
+ */
+static unsigned bio_chain_to_iovec(struct bio *bio, struct iovec **iov,
+				   unsigned *nr_iov)
 {
-	struct iovec *iov;
 	struct bvec_iter iter;
 	struct bio_vec bv;
-	ssize_t ret;
-	unsigned i;
+	struct bio *b;
+	unsigned i = 0;
+
+	for (b = bio; b; b = b->bi_next)
+		i += bio_segments(b);
+
+	if (i > *nr_iov) {
+		*iov	= xrealloc(*iov, sizeof(**iov) * i);
+		*nr_iov	= i;
+	}
+
+	i = 0;
+	for (b = bio; b; b = b->bi_next)
+		bio_for_each_segment(bv, b, iter)
+			(*iov)[i++] = (struct iovec) {
+				.iov_base = page_address(bv.bv_page) + bv.bv_offset,
+				.iov_len = bv.bv_len,
+			};
+
+	return i;
+}
+
+/* Split a completed request back up into its bios, and queue them on @done: */
+static void bio_chain_complete(struct bio *bio, long res,
+			       struct bio_list *done)
+{
+	struct bio *next;
+	long size = 0;
 
-	if (bio->bi_opf & REQ_PREFLUSH) {
-		ret = fdatasync(bio->bi_bdev->bd_fd);
-		if (ret) {
-			fprintf(stderr, "fsync error: %m\n");
+	for (next = bio; next; next = next->bi_next)
+		size += next->bi_iter.bi_size;
+
+	while (bio) {
+		next = bio->bi_next;
+		bio->bi_next = NULL;
+
+		if (res != size)
 			bio->bi_status = BLK_STS_IOERR;
-			bio_endio(bio);
-			return;
+
+		bio_list_add(done, bio);
+		bio = next;
+	}
+}
+
+static void bio_chain_endio(struct bio *bio, long res)
+{
+	struct bio_list done = BIO_EMPTY_LIST;
+
+	bio_chain_complete(bio, res, &done);
+
+	while ((bio = bio_list_pop(&done)))
+		bio_endio(bio);
+}
+
+static void endio_pool_add(struct bio_list *done)
+{
+	if (bio_list_empty(done))
+		return;
+
+	pthread_mutex_lock(&endio_pool.lock);
+	bio_list_merge(&endio_pool.bios, done);
+	pthread_cond_broadcast(&endio_pool.wait);
+	pthread_mutex_unlock(&endio_pool.lock);
+
+	bio_list_init(done);
+}
+
+static int endio_thread(void *arg)
+{
+	struct bio *bio;
+
+	pthread_mutex_lock(&endio_pool.lock);
+	while (1) {
+		bio = bio_list_pop(&endio_pool.bios);
+		if (!bio) {
+			pthread_cond_wait(&endio_pool.wait, &endio_pool.lock);
+			continue;
 		}
+
+		pthread_mutex_unlock(&endio_pool.lock);
+		bio_endio(bio);
+		pthread_mutex_lock(&endio_pool.lock);
 	}
+	pthread_mutex_unlock(&endio_pool.lock);
 
-	i = 0;
-	bio_for_each_segment(bv, bio, iter)
-		i++;
+	return 0;
+}
+
+/*
+ * Submit everything queued in the SQ ring: with IORING_FEAT_SUBMIT_STABLE the
+ * kernel has consumed the SQEs (and the iovecs they point to) by the time
+ * io_uring_enter() returns, so their slots may be reused afterwards:
+ */
+static void uring_submit_locked(struct uring *r)
+{
+	int ret;
 
-	iov = alloca(sizeof(*iov) * i);
+	if (r->sq_pending)
+		smp_store_release(r->sq_ktail, r->sq_tail);
 
-	i = 0;
-	bio_for_each_segment(bv, bio, iter)
-		iov[i++] = (struct iovec) {
-			.iov_base = page_address(bv.bv_page) + bv.bv_offset,
-			.iov_len = bv.bv_len,
+	while (r->sq_pending) {
+		ret = io_uring_enter(r->fd, r->sq_pending, 0, 0);
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (ret < 0)
+			die("io_uring_enter() error: %m");
+
+		r->sq_pending -= ret;
+	}
+}
+
+/*
+ * Reserve CQ ring slots for the SQEs we're about to queue, and make room for
+ * them in the SQ ring; we can't sleep with sq_lock held, since completions
+ * may submit more IO:
+ */
+static void uring_reserve_locked(struct uring *r, unsigned nr)
+{
+	unsigned i;
+
+	for (i = 0; i < nr; i++)
+		if (down_trylock(&r->cq_space)) {
+			uring_submit_locked(r);
+			mutex_unlock(&r->sq_lock);
+			down(&r->cq_space);
+			mutex_lock(&r->sq_lock);
+		}
+
+	if (r->sq_tail + nr - smp_load_acquire(r->sq_khead) > r->sq_mask + 1)
+		uring_submit_locked(r);
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *r,
+					  struct uring_slot **slot)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx = r->sq_tail & r->sq_mask;
+
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+
+	r->sq_array[idx] = idx;
+	r->sq_tail++;
+	r->sq_pending++;
+
+	*slot = &r->slots[idx];
+	return sqe;
+}
+
+static void uring_queue_locked(struct uring *r, struct bio *bio)
+{
+	struct block_device *bdev = bio->bi_bdev;
+	struct io_uring_sqe *sqe;
+	struct uring_slot *slot;
+	bool preflush = bio->bi_opf & REQ_PREFLUSH;
+	bool rw = bio_op(bio) == REQ_OP_READ ||
+		  bio_op(bio) == REQ_OP_WRITE;
+
+	if (!rw && bio_op(bio) != REQ_OP_FLUSH)
+		BUG();
+
+	if (rw && !bio->bi_iter.bi_size && preflush) {
+		/* empty preflush write is just a flush: */
+		rw = false;
+		preflush = false;
+	}
+
+	/* a preflush is an fsync linked to the write, queued back to back: */
+	uring_reserve_locked(r, 1 + (rw && preflush));
+
+	if (!rw || preflush) {
+		sqe = uring_get_sqe(r, &slot);
+		sqe->opcode		= IORING_OP_FSYNC;
+		sqe->fd			= bdev->bd_fd;
+		sqe->fsync_flags	= IORING_FSYNC_DATASYNC;
+		sqe->user_data		= (unsigned long) bio;
+
+		if (rw) {
+			/* the write is cancelled if the flush fails: */
+			sqe->flags	|= IOSQE_IO_LINK;
+			sqe->user_data	|= URING_PREFLUSH;
+		}
+	}
+
+	if (rw) {
+		sqe = uring_get_sqe(r, &slot);
+		sqe->opcode		= bio_op(bio) == REQ_OP_READ
+			? IORING_OP_READV
+			: IORING_OP_WRITEV;
+		sqe->fd			= bdev->bd_fd;
+		sqe->off		= bio->bi_iter.bi_sector << 9;
+		sqe->len		= bio_chain_to_iovec(bio, &slot->iov,
+							     &slot->nr_iov);
+		sqe->addr		= (unsigned long) slot->iov;
+		sqe->rw_flags		= bio->bi_opf & REQ_FUA ? RWF_DSYNC : 0;
+		sqe->user_data		= (unsigned long) bio;
+	}
+}
+
+/* @bios all belong to the same device: */
+static void uring_submit_bios(struct bio **bios, unsigned nr)
+{
+	struct uring *r = &bios[0]->bi_bdev->bd_ioctx->uring;
+	unsigned i;
+
+	mutex_lock(&r->sq_lock);
+	for (i = 0; i < nr; i++)
+		uring_queue_locked(r, bios[i]);
+	uring_submit_locked(r);
+	mutex_unlock(&r->sq_lock);
+}
+
+/* @bios all belong to the same device: */
+static void aio_submit_bios(struct bio **bios, unsigned nr)
+{
+	struct blkdev_ioctx *ctx = bios[0]->bi_bdev->bd_ioctx;
+	struct iocb *iocbs = xmalloc(sizeof(*iocbs) * nr);
+	struct iocb **iocbps = xmalloc(sizeof(*iocbps) * nr);
+	struct iovec **iovs = xmalloc(sizeof(*iovs) * nr);
+	unsigned i, nr_iocbs = 0, submitted = 0;
+	ssize_t ret;
+
+	for (i = 0; i < nr; i++) {
+		struct bio *bio = bios[i];
+		struct iocb *iocb = &iocbs[nr_iocbs];
+		unsigned nr_iov = 0;
+
+		if (bio->bi_opf & REQ_PREFLUSH) {
+			ret = fdatasync(bio->bi_bdev->bd_fd);
+			if (ret) {
+				fprintf(stderr, "fsync error: %m\n");
+				bio->bi_status = BLK_STS_IOERR;
+				bio_chain_endio(bio, 0);
+				continue;
+			}
+		}
+
+		switch (bio_op(bio)) {
+		case REQ_OP_READ:
+		case REQ_OP_WRITE:
+			break;
+		case REQ_OP_FLUSH:
+			ret = fsync(bio->bi_bdev->bd_fd);
+			if (ret)
+				die("fsync error: %m");
+			bio_endio(bio);
+			continue;
+		default:
+			BUG();
+		}
+
+		iovs[nr_iocbs] = NULL;
+
+		*iocb = (struct iocb) {
+			.data		= bio,
+			.aio_fildes	= bio->bi_opf & REQ_FUA
+				? bio->bi_bdev->bd_sync_fd
+				: bio->bi_bdev->bd_fd,
+			.aio_lio_opcode	= bio_op(bio) == REQ_OP_READ
+				? IO_CMD_PREADV
+				: IO_CMD_PWRITEV,
 		};
 
-	struct iocb iocb = {
-		.data		= bio,
-		.aio_fildes	= bio->bi_opf & REQ_FUA
-			? bio->bi_bdev->bd_sync_fd
-			: bio->bi_bdev->bd_fd,
-	}, *iocbp = &iocb;
-
-	switch (bio_op(bio)) {
-	case REQ_OP_READ:
-		iocb.aio_lio_opcode	= IO_CMD_PREADV;
-		iocb.u.v.vec		= iov;
-		iocb.u.v.nr		= i;
-		iocb.u.v.offset		= bio->bi_iter.bi_sector << 9;
-
-		ret = io_submit(aio_ctx, 1, &iocbp);
-		if (ret != 1)
-			die("io_submit err: %s", strerror(-ret));
-		break;
-	case REQ_OP_WRITE:
-		iocb.aio_lio_opcode	= IO_CMD_PWRITEV;
-		iocb.u.v.vec		= iov;
-		iocb.u.v.nr		= i;
-		iocb.u.v.offset		= bio->bi_iter.bi_sector << 9;
-
-		ret = io_submit(aio_ctx, 1, &iocbp);
-		if (ret != 1)
+		iocb->u.v.nr		= bio_chain_to_iovec(bio, &iovs[nr_iocbs],
+							     &nr_iov);
+		iocb->u.v.vec		= iovs[nr_iocbs];
+		iocb->u.v.offset	= bio->bi_iter.bi_sector << 9;
+
+		iocbps[nr_iocbs++] = iocb;
+	}
+
+	while (submitted < nr_iocbs) {
+		unsigned n = 0;
+
+		/* submit what we have space for, then wait for the rest: */
+		do {
+			if (down_trylock(&ctx->aio_space)) {
+				if (n)
+					break;
+				down(&ctx->aio_space);
+			}
+		} while (++n < nr_iocbs - submitted);
+
+		ret = io_submit(ctx->aio_ctx, n, iocbps + submitted);
+		if (ret <= 0)
 			die("io_submit err: %s", strerror(-ret));
-		break;
-	case REQ_OP_FLUSH:
-		ret = fsync(bio->bi_bdev->bd_fd);
-		if (ret)
-			die("fsync error: %m");
-		bio_endio(bio);
-		break;
-	default:
-		BUG();
+
+		submitted += ret;
+		while (n-- > ret)
+			up(&ctx->aio_space);
+	}
+
+	for (i = 0; i < nr_iocbs; i++)
+		free(iovs[i]);
+	free(iovs);
+	free(iocbps);
+	free(iocbs);
+}
+
+static void submit_bios(struct bio **bios, unsigned nr)
+{
+	unsigned i, j;
+
+	for (i = 0; i < nr; i = j) {
+		for (j = i + 1;
+		     j < nr && bios[j]->bi_bdev == bios[i]->bi_bdev;
+		     j++)
+			;
+
+		if (io_engine == BLKDEV_IO_URING)
+			uring_submit_bios(bios + i, j - i);
+		else
+			aio_submit_bios(bios + i, j - i);
+	}
+}
+
+struct plug_entry {
+	struct bio		*bio;
+	unsigned		seq;
+};
+
+static inline int plug_entry_cmp(const void *_l, const void *_r)
+{
+	const struct plug_entry *l = _l, *r = _r;
+	const struct bio *lb = l->bio, *rb = r->bio;
+
+	if (lb->bi_bdev != rb->bi_bdev)
+		return lb->bi_bdev < rb->bi_bdev ? -1 : 1;
+	if (bio_op(lb) != bio_op(rb))
+		return bio_op(lb) < bio_op(rb) ? -1 : 1;
+	if (lb->bi_iter.bi_sector != rb->bi_iter.bi_sector)
+		return lb->bi_iter.bi_sector < rb->bi_iter.bi_sector ? -1 : 1;
+	return l->seq < r->seq ? -1 : l->seq > r->seq;
+}
+
+static bool bio_can_merge(struct bio *prev, unsigned prev_segs,
+			  struct bio *next)
+{
+	return prev->bi_bdev == next->bi_bdev &&
+		bio_op(prev) == bio_op(next) &&
+		bio_end_sector(prev) == next->bi_iter.bi_sector &&
+		prev_segs + bio_segments(next) <= UIO_MAXIOV;
+}
+
+/*
+ * Sort plugged bios by device and sector, merge runs of contiguous bios into
+ * single requests, and submit them all at once:
+ */
+static void blk_flush_plug_list(struct blk_plug *plug)
+{
+	struct plug_entry entries[BLK_MAX_REQUEST_COUNT];
+	struct bio *reqs[BLK_MAX_REQUEST_COUNT];
+	struct bio *tail = NULL;
+	unsigned i, nr = plug->nr_bios, nr_reqs = 0, segs = 0;
+
+	if (!nr)
+		return;
+
+	/* detach first: submitting may sleep, and schedule() flushes plugs */
+	for (i = 0; i < nr; i++)
+		entries[i] = (struct plug_entry) {
+			.bio	= plug->bios[i],
+			.seq	= i,
+		};
+	plug->nr_bios = 0;
+
+	sort(entries, nr, sizeof(entries[0]), plug_entry_cmp, NULL);
+
+	for (i = 0; i < nr; i++) {
+		struct bio *bio = entries[i].bio;
+
+		if (tail && bio_can_merge(tail, segs, bio)) {
+			tail->bi_next	= bio;
+			tail		= bio;
+			segs		+= bio_segments(bio);
+			continue;
+		}
+
+		reqs[nr_reqs++]	= bio;
+		tail		= bio;
+		segs		= bio_segments(bio);
 	}
+
+	submit_bios(reqs, nr_reqs);
+}
+
+void blk_start_plug(struct blk_plug *plug)
+{
+	plug->nr_bios = 0;
+
+	/* only the outermost plug does anything: */
+	if (!current->plug)
+		current->plug = plug;
+}
+
+void blk_finish_plug(struct blk_plug *plug)
+{
+	if (plug != current->plug)
+		return;
+
+	blk_flush_plug_list(plug);
+	current->plug = NULL;
+}
+
+void blk_schedule_flush_plug(struct task_struct *tsk)
+{
+	if (tsk->plug)
+		blk_flush_plug_list(tsk->plug);
+}
+
+void generic_make_request(struct bio *bio)
+{
+	struct blk_plug *plug = current->plug;
+
+	bio->bi_next = NULL;
+
+	if (plug) {
+		if ((bio_op(bio) == REQ_OP_READ ||
+		     bio_op(bio) == REQ_OP_WRITE) &&
+		    bio_mergeable(bio)) {
+			plug->bios[plug->nr_bios++] = bio;
+
+			if (plug->nr_bios == BLK_MAX_REQUEST_COUNT)
+				blk_flush_plug_list(plug);
+			return;
+		}
+
+		/* flushes must be ordered after writes we've been holding: */
+		blk_flush_plug_list(plug);
+	}
+
+	submit_bios(&bio, 1);
 }
 
 static void submit_bio_wait_endio(struct bio *bio)
@@ -154,10 +623,275 @@ sector_t get_capacity(struct gendisk *disk)
 	return bytes >> 9;
 }
 
+static int uring_reaper_thread(void *arg)
+{
+	struct uring *r = arg;
+	struct bio_list done = BIO_EMPTY_LIST;
+	struct io_uring_cqe *cqe;
+	struct bio *bio;
+	unsigned head, tail, nr;
+	bool stop = false;
+	u64 user_data;
+	s32 res;
+	int ret;
+
+	while (!stop) {
+		head = *r->cq_khead;
+		tail = smp_load_acquire(r->cq_ktail);
+
+		if (head == tail) {
+			ret = io_uring_enter(r->fd, 0, 1,
+					     IORING_ENTER_GETEVENTS);
+			if (ret < 0 && errno != EINTR)
+				die("io_uring_enter() error: %m");
+			continue;
+		}
+
+		for (nr = 0; head != tail; head++, nr++) {
+			cqe		= &r->cqes[head & r->cq_mask];
+			user_data	= cqe->user_data;
+			res		= cqe->res;
+
+			bio = (struct bio *) (unsigned long)
+				(user_data & ~URING_PREFLUSH);
+
+			if (!bio) {
+				/* blkdev_put() is shutting us down: */
+				stop = true;
+				continue;
+			}
+
+			if (user_data & URING_PREFLUSH) {
+				/*
+				 * On failure the linked write completes with
+				 * -ECANCELED, and that's where the bio is ended:
+				 */
+				if (res) {
+					fprintf(stderr, "fsync error: %s\n",
+						strerror(-res));
+					bio->bi_status = BLK_STS_IOERR;
+				}
+				continue;
+			}
+
+			bio_chain_complete(bio, res, &done);
+		}
+
+		smp_store_release(r->cq_khead, head);
+
+		/* release CQ space first, since endio may submit more IO: */
+		while (nr--)
+			up(&r->cq_space);
+
+		endio_pool_add(&done);
+	}
+
+	return 0;
+}
+
+static int aio_reaper_thread(void *arg)
+{
+	struct blkdev_ioctx *ctx = arg;
+	struct bio_list done = BIO_EMPTY_LIST;
+	struct io_event events[64], *ev;
+	bool stop = false;
+	int ret;
+
+	while (!stop) {
+		ret = io_getevents(ctx->aio_ctx, 1, ARRAY_SIZE(events),
+				   events, NULL);
+
+		if (ret < 0 && ret == -EINTR)
+			continue;
+		if (ret < 0)
+			die("io_getevents() error: %s", strerror(-ret));
+
+		for (ev = events; ev < events + ret; ev++) {
+			if (ev->data)
+				bio_chain_complete(ev->data, ev->res, &done);
+			else
+				stop = true;
+
+			/* release ring space first, since endio may submit more IO: */
+			up(&ctx->aio_space);
+		}
+
+		endio_pool_add(&done);
+	}
+
+	return 0;
+}
+
+static int uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	void *sq_ring, *cq_ring;
+	size_t sq_size, cq_size;
+
+	memset(&p, 0, sizeof(p));
+
+	r->fd = io_uring_setup(entries, &p);
+	if (r->fd < 0)
+		return -errno;
+
+	/* we rely on SQEs being consumed by io_uring_enter(): */
+	if (!(p.features & IORING_FEAT_SUBMIT_STABLE)) {
+		close(r->fd);
+		return -EOPNOTSUPP;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = max(sq_size, cq_size);
+
+	sq_ring = mmap(NULL, sq_size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		die("io_uring mmap error: %m");
+
+	cq_ring = p.features & IORING_FEAT_SINGLE_MMAP
+		? sq_ring
+		: mmap(NULL, cq_size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	if (cq_ring == MAP_FAILED)
+		die("io_uring mmap error: %m");
+
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		       PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		die("io_uring mmap error: %m");
+
+	r->sq_ring	= sq_ring;
+	r->sq_ring_size	= sq_size;
+	r->cq_ring	= cq_ring;
+	r->cq_ring_size	= cq_size;
+	r->nr_sqes	= p.sq_entries;
+
+	r->sq_khead	= sq_ring + p.sq_off.head;
+	r->sq_ktail	= sq_ring + p.sq_off.tail;
+	r->sq_mask	= *(unsigned *) (sq_ring + p.sq_off.ring_mask);
+	r->sq_array	= sq_ring + p.sq_off.array;
+	r->sq_tail	= *r->sq_ktail;
+
+	r->cq_khead	= cq_ring + p.cq_off.head;
+	r->cq_ktail	= cq_ring + p.cq_off.tail;
+	r->cq_mask	= *(unsigned *) (cq_ring + p.cq_off.ring_mask);
+	r->cqes		= cq_ring + p.cq_off.cqes;
+
+	r->slots = calloc(p.sq_entries, sizeof(r->slots[0]));
+	if (!r->slots)
+		die("allocation failure");
+
+	mutex_init(&r->sq_lock);
+	sema_init(&r->cq_space, p.cq_entries);
+	return 0;
+}
+
+static void uring_exit(struct uring *r)
+{
+	unsigned i;
+
+	for (i = 0; i < r->nr_sqes; i++)
+		free(r->slots[i].iov);
+	free(r->slots);
+
+	munmap(r->sqes, r->nr_sqes * sizeof(struct io_uring_sqe));
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+}
+
+static struct blkdev_ioctx *blkdev_ioctx_alloc(void)
+{
+	struct blkdev_ioctx *ctx = calloc(1, sizeof(*ctx));
+	int ret;
+
+	if (!ctx)
+		return ERR_PTR(-ENOMEM);
+
+	if (io_engine == BLKDEV_IO_URING) {
+		ret = uring_init(&ctx->uring, io_depth);
+		if (ret)
+			goto err;
+
+		ctx->reaper = kthread_run(uring_reaper_thread, &ctx->uring,
+					  "uring_reaper");
+	} else {
+		ret = io_setup(io_depth, &ctx->aio_ctx);
+		if (ret)
+			goto err;
+
+		sema_init(&ctx->aio_space, io_depth);
+
+		ctx->reaper = kthread_run(aio_reaper_thread, ctx,
+					  "aio_reaper");
+	}
+
+	BUG_ON(IS_ERR(ctx->reaper));
+	/* the reaper exits on its own, keep it around for kthread_stop(): */
+	get_task_struct(ctx->reaper);
+	return ctx;
+err:
+	free(ctx);
+	return ERR_PTR(ret);
+}
+
+/*
+ * Called with no IO outstanding: the reaper exits when it sees a completion
+ * with no bio attached.
+ */
+static void blkdev_ioctx_free(struct block_device *bdev)
+{
+	struct blkdev_ioctx *ctx = bdev->bd_ioctx;
+	int ret;
+
+	if (io_engine == BLKDEV_IO_URING) {
+		struct uring *r = &ctx->uring;
+		struct io_uring_sqe *sqe;
+		struct uring_slot *slot;
+
+		mutex_lock(&r->sq_lock);
+		uring_reserve_locked(r, 1);
+		sqe = uring_get_sqe(r, &slot);
+		sqe->opcode	= IORING_OP_NOP;
+		sqe->user_data	= 0;
+		uring_submit_locked(r);
+		mutex_unlock(&r->sq_lock);
+	} else {
+		struct iocb iocb = {
+			.data		= NULL,
+			.aio_fildes	= bdev->bd_fd,
+			.aio_lio_opcode	= IO_CMD_PREAD,
+		}, *iocbp = &iocb;
+
+		/* a zero length read, just to wake up the reaper: */
+		down(&ctx->aio_space);
+		ret = io_submit(ctx->aio_ctx, 1, &iocbp);
+		if (ret != 1)
+			die("io_submit err: %s", strerror(-ret));
+	}
+
+	kthread_stop(ctx->reaper);
+	put_task_struct(ctx->reaper);
+
+	if (io_engine == BLKDEV_IO_URING)
+		uring_exit(&ctx->uring);
+	else
+		io_destroy(ctx->aio_ctx);
+
+	free(ctx);
+}
+
 void blkdev_put(struct block_device *bdev, fmode_t mode)
 {
 	fdatasync(bdev->bd_fd);
-	close(bdev->bd_sync_fd);
+	blkdev_ioctx_free(bdev);
+	if (bdev->bd_sync_fd >= 0)
+		close(bdev->bd_sync_fd);
 	close(bdev->bd_fd);
 	free(bdev);
 }
@@ -166,7 +900,7 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 					void *holder)
 {
 	struct block_device *bdev;
-	int fd, sync_fd, flags = O_DIRECT;
+	int fd, sync_fd = -1, flags = O_DIRECT;
 
 	if ((mode & (FMODE_READ|FMODE_WRITE)) == (FMODE_READ|FMODE_WRITE))
 		flags = O_RDWR;
@@ -185,11 +919,14 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 	if (fd < 0)
 		return ERR_PTR(-errno);
 
-	sync_fd = open(path, flags|O_SYNC);
-	if (sync_fd < 0) {
-		assert(0);
-		close(fd);
-		return ERR_PTR(-errno);
+	/* io_uring does FUA writes with RWF_DSYNC, aio needs an O_SYNC fd: */
+	if (io_engine == BLKDEV_IO_AIO) {
+		sync_fd = open(path, flags|O_SYNC);
+		if (sync_fd < 0) {
+			assert(0);
+			close(fd);
+			return ERR_PTR(-errno);
+		}
 	}
 
 	bdev = malloc(sizeof(*bdev));
@@ -205,6 +942,17 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 	bdev->bd_bdi		= &bdev->__bd_bdi;
 	bdev->queue.backing_dev_info = bdev->bd_bdi;
 
+	bdev->bd_ioctx		= blkdev_ioctx_alloc();
+	if (IS_ERR(bdev->bd_ioctx)) {
+		int ret = PTR_ERR(bdev->bd_ioctx);
+
+		if (sync_fd >= 0)
+			close(sync_fd);
+		close(fd);
+		free(bdev);
+		return ERR_PTR(ret);
+	}
+
 	return bdev;
 }
 
@@ -218,41 +966,55 @@ struct block_device *lookup_bdev(const char *path)
 	return ERR_PTR(-EINVAL);
 }
 
-static int aio_completion_thread(void *arg)
+static unsigned getenv_uint(const char *name, unsigned def)
 {
-	struct io_event events[8], *ev;
-	int ret;
-
-	while (1) {
-		ret = io_getevents(aio_ctx, 1, ARRAY_SIZE(events),
-				   events, NULL);
-
-		if (ret < 0 && ret == -EINTR)
-			continue;
-		if (ret < 0)
-			die("io_getevents() error: %s", strerror(-ret));
-
-		for (ev = events; ev < events + ret; ev++) {
-			struct bio *bio = (struct bio *) ev->data;
+	const char *v = getenv(name);
+	unsigned long ret;
+	char *end;
 
-			if (ev->res != bio->bi_iter.bi_size)
-				bio->bi_status = BLK_STS_IOERR;
+	if (!v)
+		return def;
 
-			bio_endio(bio);
-		}
-	}
+	ret = strtoul(v, &end, 10);
+	if (!*v || *end || ret > UINT_MAX)
+		die("invalid %s: %s", name, v);
 
-	return 0;
+	return ret;
 }
 
 __attribute__((constructor(102)))
 static void blkdev_init(void)
 {
-	struct task_struct *p;
+	const char *engine = getenv("BCACHEFS_IO_ENGINE");
+	unsigned i;
+
+	io_depth = getenv_uint("BCACHEFS_IO_DEPTH", io_depth);
+	if (!io_depth)
+		die("invalid BCACHEFS_IO_DEPTH: 0");
+
+	endio_pool.nr_threads = getenv_uint("BCACHEFS_IO_COMPLETION_THREADS",
+			min_t(long, endio_pool.nr_threads,
+			      sysconf(_SC_NPROCESSORS_ONLN)));
+	if (!endio_pool.nr_threads)
+		die("invalid BCACHEFS_IO_COMPLETION_THREADS: 0");
+
+	io_engine = BLKDEV_IO_AIO;
 
-	if (io_setup(256, &aio_ctx))
-		die("io_setup() error: %m");
+	if (!engine || strcmp(engine, "aio")) {
+		struct uring probe;
+		int ret = uring_init(&probe, 1);
 
-	p = kthread_run(aio_completion_thread, NULL, "aio_completion");
-	BUG_ON(IS_ERR(p));
+		if (!ret) {
+			uring_exit(&probe);
+			io_engine = BLKDEV_IO_URING;
+		} else if (engine && !strcmp(engine, "io_uring")) {
+			die("io_uring_setup() error: %s", strerror(-ret));
+		}
+	}
+
+	for (i = 0; i < endio_pool.nr_threads; i++) {
+		struct task_struct *p =
+			kthread_run(endio_thread, NULL, "bio_endio/%u", i);
+		BUG_ON(IS_ERR(p));
+	}
 }
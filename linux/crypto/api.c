@@ -22,6 +22,8 @@
 #include <crypto/algapi.h>
 #include "internal.h"
 
+#include <sodium/core.h>
+
 static LIST_HEAD(crypto_alg_list);
 static DECLARE_RWSEM(crypto_alg_sem);
 
@@ -234,3 +236,13 @@ struct crypto_skcipher *crypto_alloc_skcipher(const char *alg_name,
 {
 	return crypto_alloc_tfm(alg_name, &crypto_skcipher_type2, type, mask);
 }
+
+/*
+ * libsodium only switches from its reference code to the SIMD implementations
+ * of ChaCha20 and Poly1305 that the cpu supports once it's initialized:
+ */
+__attribute__((constructor(109)))
+static void crypto_init(void)
+{
+	BUG_ON(sodium_init() < 0);
+}
@@ -91,8 +91,66 @@ static struct skcipher_alg alg = {
 	.decrypt		= crypto_chacha20_crypt,
 };
 
+/*
+ * Known answer test (RFC7539 2.4.2) for the implementation libsodium picked,
+ * and a check that a multi-block call - the SIMD paths - matches encrypting a
+ * block at a time:
+ */
+static bool chacha20_selftest(void)
+{
+	static const char pt[] = "Ladies and Gentlemen of the class of '99: "
+		"If I could offer you only one tip for the future, "
+		"sunscreen would be it.";
+	static const u8 ct[] = {
+		0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80,
+		0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81,
+		0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2,
+		0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b,
+		0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab,
+		0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+		0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab,
+		0x8f, 0x53, 0x0c, 0x35, 0x9f, 0x08, 0x61, 0xd8,
+		0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61,
+		0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e,
+		0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06,
+		0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+		0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6,
+		0xb4, 0x0b, 0x8e, 0xed, 0xf2, 0x78, 0x5e, 0x42,
+		0x87, 0x4d,
+	};
+	static const u8 nonce[8] = { 0, 0, 0, 0x4a };
+	u8 key[CHACHA20_KEY_SIZE], buf[sizeof(ct)];
+	u8 multi[CHACHA20_BLOCK_SIZE * 16], single[sizeof(multi)];
+	unsigned i;
+
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = i;
+
+	crypto_stream_chacha20_xor_ic(buf, (const u8 *) pt, sizeof(buf),
+				      nonce, 1, key);
+	if (memcmp(buf, ct, sizeof(ct)))
+		return false;
+
+	memset(multi, 0, sizeof(multi));
+	memset(single, 0, sizeof(single));
+
+	crypto_stream_chacha20_xor_ic(multi, multi, sizeof(multi),
+				      nonce, 0, key);
+	for (i = 0; i < sizeof(single); i += CHACHA20_BLOCK_SIZE)
+		crypto_stream_chacha20_xor_ic(single + i, single + i,
+					      CHACHA20_BLOCK_SIZE, nonce,
+					      i / CHACHA20_BLOCK_SIZE, key);
+
+	return !memcmp(multi, single, sizeof(multi));
+}
+
 __attribute__((constructor(110)))
 static int chacha20_generic_mod_init(void)
 {
+	if (!chacha20_selftest()) {
+		fprintf(stderr, "chacha20: self test failed\n");
+		return -EINVAL;
+	}
+
 	return crypto_register_alg(&alg.base);
 }
@@ -69,8 +69,33 @@ static struct shash_alg poly1305_alg = {
 	},
 };
 
+/* Known answer test, RFC7539 2.5.2: */
+static bool poly1305_selftest(void)
+{
+	static const u8 key[crypto_onetimeauth_poly1305_KEYBYTES] = {
+		0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33,
+		0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+		0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd,
+		0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b,
+	};
+	static const char msg[] = "Cryptographic Forum Research Group";
+	static const u8 tag[crypto_onetimeauth_poly1305_BYTES] = {
+		0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6,
+		0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9,
+	};
+	u8 out[sizeof(tag)];
+
+	crypto_onetimeauth_poly1305(out, (const u8 *) msg, strlen(msg), key);
+	return !memcmp(out, tag, sizeof(tag));
+}
+
 __attribute__((constructor(110)))
 static int poly1305_mod_init(void)
 {
+	if (!poly1305_selftest()) {
+		fprintf(stderr, "poly1305: self test failed\n");
+		return -EINVAL;
+	}
+
 	return crypto_register_shash(&poly1305_alg);
 }
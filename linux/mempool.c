@@ -0,0 +1,291 @@
+#include <linux/gfp.h>
+#include <linux/mempool.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+
+/*
+ * Unlike the kernel, allocations are satisfied from the reserve first: the
+ * reserve doubles as a cache of recently freed elements, so steady state
+ * allocations don't hit malloc(). We only go to the underlying allocator when
+ * the reserve is empty, and only wait when that fails too.
+ */
+
+#define SLOT_IDX(v)	((u32) (v))
+#define SLOT_GEN(v)	((v) >> 32)
+
+static u32 slot_pop(struct mempool_slot *slots, u64 *head)
+{
+	u64 old, new, v = READ_ONCE(*head);
+
+	do {
+		old = v;
+		if (!SLOT_IDX(old))
+			return 0;
+
+		new = (SLOT_GEN(old) + 1) << 32 |
+			READ_ONCE(slots[SLOT_IDX(old) - 1].next);
+	} while ((v = cmpxchg(head, old, new)) != old);
+
+	return SLOT_IDX(old);
+}
+
+static void slot_push(struct mempool_slot *slots, u64 *head, u32 idx)
+{
+	u64 old, new, v = READ_ONCE(*head);
+
+	do {
+		old = v;
+		WRITE_ONCE(slots[idx - 1].next, SLOT_IDX(old));
+		new = (SLOT_GEN(old) + 1) << 32 | idx;
+	} while ((v = cmpxchg(head, old, new)) != old);
+}
+
+static bool add_element(mempool_t *pool, void *element)
+{
+	u32 idx = slot_pop(pool->elements, &pool->empty);
+
+	if (!idx)
+		return false;
+
+	pool->elements[idx - 1].element = element;
+	slot_push(pool->elements, &pool->full, idx);
+	return true;
+}
+
+static void *remove_element(mempool_t *pool)
+{
+	u32 idx = slot_pop(pool->elements, &pool->full);
+	void *element;
+
+	if (!idx)
+		return NULL;
+
+	element = pool->elements[idx - 1].element;
+	slot_push(pool->elements, &pool->empty, idx);
+	return element;
+}
+
+static bool mempool_has_elements(mempool_t *pool)
+{
+	return SLOT_IDX(READ_ONCE(pool->full)) != 0;
+}
+
+void mempool_exit(mempool_t *pool)
+{
+	void *element;
+
+	if (!pool->elements)
+		return;
+
+	while ((element = remove_element(pool)))
+		pool->free(element, pool->pool_data);
+	kfree(pool->elements);
+	pool->elements = NULL;
+}
+
+void mempool_destroy(mempool_t *pool)
+{
+	if (unlikely(!pool))
+		return;
+
+	mempool_exit(pool);
+	kfree(pool);
+}
+
+static int mempool_slots_init(mempool_t *pool, int min_nr)
+{
+	int i;
+
+	/* always allocate, so that mempool_initialized() works for min_nr 0: */
+	pool->elements = kcalloc(max(min_nr, 1), sizeof(struct mempool_slot),
+				 GFP_KERNEL);
+	if (!pool->elements)
+		return -ENOMEM;
+
+	pool->min_nr	= min_nr;
+	pool->full	= 0;
+	pool->empty	= 0;
+
+	for (i = min_nr; i; --i)
+		slot_push(pool->elements, &pool->empty, i);
+	return 0;
+}
+
+int mempool_init(mempool_t *pool, int min_nr, mempool_alloc_t *alloc_fn,
+		 mempool_free_t *free_fn, void *pool_data)
+{
+	int i;
+
+	init_waitqueue_head(&pool->wait);
+	pool->pool_data	= pool_data;
+	pool->alloc	= alloc_fn;
+	pool->free	= free_fn;
+
+	if (mempool_slots_init(pool, min_nr))
+		return -ENOMEM;
+
+	/*
+	 * First pre-allocate the guaranteed number of buffers.
+	 */
+	for (i = 0; i < min_nr; i++) {
+		void *element = pool->alloc(GFP_KERNEL, pool->pool_data);
+
+		if (unlikely(!element)) {
+			mempool_exit(pool);
+			return -ENOMEM;
+		}
+
+		add_element(pool, element);
+	}
+
+	return 0;
+}
+
+mempool_t *mempool_create(int min_nr, mempool_alloc_t *alloc_fn,
+			  mempool_free_t *free_fn, void *pool_data)
+{
+	mempool_t *pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+
+	if (!pool)
+		return NULL;
+
+	if (mempool_init(pool, min_nr, alloc_fn, free_fn, pool_data)) {
+		kfree(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/*
+ * Resizing replaces the slot array, so unlike the kernel the caller must
+ * ensure there are no concurrent mempool_alloc()/mempool_free() calls:
+ */
+int mempool_resize(mempool_t *pool, int new_min_nr)
+{
+	struct mempool_slot *old_elements = pool->elements;
+	void **reserve, *element;
+	int i, nr = 0;
+
+	BUG_ON(new_min_nr <= 0);
+
+	reserve = kmalloc_array(pool->min_nr, sizeof(void *), GFP_KERNEL);
+	if (!reserve)
+		return -ENOMEM;
+
+	while ((element = remove_element(pool)))
+		reserve[nr++] = element;
+
+	if (mempool_slots_init(pool, new_min_nr)) {
+		while (nr)
+			add_element(pool, reserve[--nr]);
+		kfree(reserve);
+		return -ENOMEM;
+	}
+	kfree(old_elements);
+
+	for (i = 0; i < nr; i++)
+		if (!add_element(pool, reserve[i]))
+			pool->free(reserve[i], pool->pool_data);
+	kfree(reserve);
+
+	for (; nr < new_min_nr; nr++) {
+		element = pool->alloc(GFP_KERNEL, pool->pool_data);
+		if (!element)
+			return -ENOMEM;
+
+		add_element(pool, element);
+	}
+
+	return 0;
+}
+
+void *mempool_alloc(mempool_t *pool, gfp_t gfp_mask)
+{
+	void *element;
+
+	while (1) {
+		element = remove_element(pool);
+		if (likely(element))
+			return element;
+
+		element = pool->alloc(gfp_mask, pool->pool_data);
+		if (likely(element))
+			return element;
+
+		if (!gfpflags_allow_blocking(gfp_mask))
+			return NULL;
+
+		/*
+		 * mempool_free() only wakes us if it sees us on the waitqueue,
+		 * which can race - so like the kernel, don't sleep forever:
+		 */
+		wait_event_timeout(pool->wait, mempool_has_elements(pool), 5*HZ);
+	}
+}
+
+void mempool_free(void *element, mempool_t *pool)
+{
+	if (unlikely(element == NULL))
+		return;
+
+	if (!add_element(pool, element)) {
+		pool->free(element, pool->pool_data);
+		return;
+	}
+
+	smp_mb();
+	if (unlikely(!list_empty(&pool->wait.task_list)))
+		wake_up(&pool->wait);
+}
+
+/*
+ * A commonly used alloc and free fn.
+ */
+void *mempool_alloc_slab(gfp_t gfp_mask, void *pool_data)
+{
+	struct kmem_cache *mem = pool_data;
+
+	return kmem_cache_alloc(mem, gfp_mask);
+}
+
+void mempool_free_slab(void *element, void *pool_data)
+{
+	struct kmem_cache *mem = pool_data;
+
+	kmem_cache_free(mem, element);
+}
+
+/*
+ * A commonly used alloc and free fn that kmalloc/kfrees the amount of memory
+ * specified by pool_data
+ */
+void *mempool_kmalloc(gfp_t gfp_mask, void *pool_data)
+{
+	size_t size = (size_t)pool_data;
+
+	return kmalloc(size, gfp_mask);
+}
+
+void mempool_kfree(void *element, void *pool_data)
+{
+	kfree(element);
+}
+
+/*
+ * A simple mempool-backed page allocator that allocates pages
+ * of the order specified by pool_data.
+ */
+void *mempool_alloc_pages(gfp_t gfp_mask, void *pool_data)
+{
+	int order = (int)(long)pool_data;
+
+	return alloc_pages(gfp_mask, order);
+}
+
+void mempool_free_pages(void *element, void *pool_data)
+{
+	int order = (int)(long)pool_data;
+
+	__free_pages(element, order);
+}
@@ -0,0 +1,100 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/cache.h>
+#include <linux/cpumask.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+
+#include "tools-util.h"
+
+/* Allocations within a unit are tracked in cacheline sized blocks: */
+#define PCPU_MIN_ALLOC_SIZE	L1_CACHE_BYTES
+#define PCPU_UNIT_BLOCKS	(PCPU_UNIT_SIZE / PCPU_MIN_ALLOC_SIZE)
+
+unsigned nr_cpu_ids = 1;
+__thread int __pcpu_cpu = -1;
+
+static void *pcpu_base;
+static atomic_t pcpu_next_cpu;
+
+static DEFINE_MUTEX(pcpu_lock);
+static DECLARE_BITMAP(pcpu_used, PCPU_UNIT_BLOCKS);
+static u16 pcpu_nr_blocks[PCPU_UNIT_BLOCKS];
+
+int __pcpu_cpu_assign(void)
+{
+	unsigned cpu = atomic_inc_return(&pcpu_next_cpu) - 1;
+
+	return __pcpu_cpu = cpu % nr_cpu_ids;
+}
+
+void __percpu *__alloc_percpu_gfp(size_t size, size_t align, gfp_t gfp)
+{
+	size_t nr = DIV_ROUND_UP(max_t(size_t, size, 1), PCPU_MIN_ALLOC_SIZE);
+	size_t step = DIV_ROUND_UP(align, PCPU_MIN_ALLOC_SIZE) ?: 1;
+	size_t i, start = 0, end;
+	void *p;
+	int cpu;
+
+	mutex_lock(&pcpu_lock);
+	while (1) {
+		start = round_up(find_next_zero_bit(pcpu_used, PCPU_UNIT_BLOCKS,
+						    start), step);
+		if (start + nr > PCPU_UNIT_BLOCKS) {
+			mutex_unlock(&pcpu_lock);
+			return NULL;
+		}
+
+		end = find_next_bit(pcpu_used, start + nr, start);
+		if (end == start + nr)
+			break;
+		start = end;
+	}
+
+	for (i = start; i < start + nr; i++)
+		__set_bit(i, pcpu_used);
+	pcpu_nr_blocks[start] = nr;
+	mutex_unlock(&pcpu_lock);
+
+	p = pcpu_base + start * PCPU_MIN_ALLOC_SIZE;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(p, cpu), 0, size);
+
+	return p;
+}
+
+void free_percpu(void __percpu *p)
+{
+	size_t i, start;
+
+	if (!p)
+		return;
+
+	start = (p - pcpu_base) / PCPU_MIN_ALLOC_SIZE;
+
+	mutex_lock(&pcpu_lock);
+	for (i = start; i < start + pcpu_nr_blocks[start]; i++)
+		__clear_bit(i, pcpu_used);
+	pcpu_nr_blocks[start] = 0;
+	mutex_unlock(&pcpu_lock);
+}
+
+__attribute__((constructor(101)))
+static void percpu_init(void)
+{
+	long nr = sysconf(_SC_NPROCESSORS_CONF);
+
+	nr_cpu_ids = clamp_t(long, nr, 1, NR_CPUS);
+
+	/* only the parts of each unit that get used are ever faulted in: */
+	pcpu_base = mmap(NULL, nr_cpu_ids * PCPU_UNIT_SIZE,
+			 PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (pcpu_base == MAP_FAILED)
+		die("error reserving percpu area: %m");
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <sys/mman.h>
 
+#include <linux/blkdev.h>
 #include <linux/math64.h>
 #include <linux/printk.h>
 #include <linux/rcupdate.h>
@@ -35,6 +36,10 @@ void schedule(void)
 
 	rcu_quiescent_state();
 
+	/* don't sleep on IO we're still holding back: */
+	if (current->plug)
+		blk_schedule_flush_plug(current);
+
 	while ((v = current->state) != TASK_RUNNING)
 		futex(&current->state, FUTEX_WAIT|FUTEX_PRIVATE_FLAG,
 		      v, NULL, NULL, 0);
@@ -1,6 +1,9 @@
-
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
+#include <unistd.h>
 
+#include <linux/kthread.h>
 #include <linux/list.h>
 #include <linux/mutex.h>
 #include <linux/shrinker.h>
@@ -10,6 +13,22 @@
 static LIST_HEAD(shrinker_list);
 static DEFINE_MUTEX(shrinker_lock);
 
+/*
+ * Checking memory pressure means parsing /proc/meminfo, which is far too slow
+ * to do on every allocation: instead a monitor thread samples it periodically
+ * (and immediately on a PSI memory pressure event, when available) and
+ * publishes how much it wants reclaimed in shrinker_want.
+ *
+ * We try to keep MemAvailable above a quarter of MemTotal; additionally, if
+ * BCACHEFS_MEM_BUDGET is set (bytes, optionally with a k/M/G/T suffix), we
+ * try to keep our resident set under it.
+ */
+#define MEM_MONITOR_INTERVAL_MS	100
+
+atomic_long_t shrinker_want;
+
+static u64 mem_budget;
+
 int register_shrinker(struct shrinker *shrinker)
 {
 	mutex_lock(&shrinker_lock);
@@ -66,22 +85,119 @@ static struct meminfo read_meminfo(void)
 	return ret;
 }
 
-void run_shrinkers(void)
+static u64 read_rss(void)
+{
+	unsigned long long size, resident = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		die("error opening /proc/self/statm: %m");
+
+	if (fscanf(f, "%llu %llu", &size, &resident) != 2)
+		die("error parsing /proc/self/statm");
+	fclose(f);
+
+	return resident << PAGE_SHIFT;
+}
+
+static s64 mem_want_shrink(void)
 {
-	struct shrinker *shrinker;
 	struct meminfo info = read_meminfo();
 	s64 want_shrink = (info.total >> 2) - info.available;
 
-	if (want_shrink <= 0)
-		return;
+	if (mem_budget)
+		want_shrink = max_t(s64, want_shrink,
+				    (s64) (read_rss() - mem_budget));
 
-	mutex_lock(&shrinker_lock);
-	list_for_each_entry(shrinker, &shrinker_list, list) {
-		struct shrink_control sc = {
-			.nr_to_scan = want_shrink >> PAGE_SHIFT
-		};
+	return want_shrink;
+}
+
+/* Returns an fd that polls POLLPRI on memory pressure, or -1: */
+static int psi_trigger_open(void)
+{
+	/* tasks stalled on memory for 100ms out of a 1s window: */
+	static const char trigger[] = "some 100000 1000000";
+	int fd;
+
+	fd = open("/proc/pressure/memory", O_RDWR|O_NONBLOCK|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (write(fd, trigger, sizeof(trigger)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int mem_monitor_thread(void *arg)
+{
+	/* poll() ignores negative fds, so without PSI this just sleeps: */
+	struct pollfd pfd = { .fd = psi_trigger_open(), .events = POLLPRI };
+
+	while (1) {
+		atomic_long_set(&shrinker_want, max_t(s64, mem_want_shrink(), 0));
 
-		shrinker->scan_objects(shrinker, &sc);
+		if (poll(&pfd, 1, MEM_MONITOR_INTERVAL_MS) < 0 &&
+		    errno != EINTR)
+			die("poll error: %m");
 	}
+
+	return 0;
+}
+
+static u64 parse_mem_budget(const char *s)
+{
+	static const char units[] = "kMGT";
+	unsigned long long v;
+	const char *u = NULL;
+	char *end;
+
+	v = strtoull(s, &end, 10);
+
+	if (*end && !end[1])
+		u = strchr(units, *end);
+
+	if (end == s || (*end && !u))
+		die("invalid BCACHEFS_MEM_BUDGET: %s", s);
+
+	return u ? v << (10 * (u - units + 1)) : v;
+}
+
+__attribute__((constructor(103)))
+static void mem_monitor_init(void)
+{
+	const char *budget = getenv("BCACHEFS_MEM_BUDGET");
+	struct task_struct *p;
+
+	if (budget)
+		mem_budget = parse_mem_budget(budget);
+
+	p = kthread_run(mem_monitor_thread, NULL, "mem_monitor");
+	BUG_ON(IS_ERR(p));
+}
+
+void __run_shrinkers(void)
+{
+	struct shrinker *shrinker;
+	s64 want_shrink;
+
+	/* if someone else is already reclaiming, don't pile on: */
+	if (!mutex_trylock(&shrinker_lock))
+		return;
+
+	/* the monitor thread will ask again if this wasn't enough: */
+	want_shrink = atomic_long_xchg(&shrinker_want, 0);
+
+	if (want_shrink > 0)
+		list_for_each_entry(shrinker, &shrinker_list, list) {
+			struct shrink_control sc = {
+				.nr_to_scan = want_shrink >> PAGE_SHIFT
+			};
+
+			shrinker->scan_objects(shrinker, &sc);
+		}
 	mutex_unlock(&shrinker_lock);
 }
@@ -0,0 +1,247 @@
+#include <pthread.h>
+
+#include <linux/cache.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+/*
+ * Free objects are cached in a per thread magazine, so the common alloc and
+ * free paths are a pthread_getspecific() and an array push/pop.
+ *
+ * Magazines exchange objects in batches with a per cache depot, protected by
+ * a mutex. The depot is bounded, and emptied when the shrinkers run.
+ */
+#define KMEM_MAGAZINE_SIZE	32
+#define KMEM_BATCH		(KMEM_MAGAZINE_SIZE / 2)
+#define KMEM_DEPOT_SIZE		(KMEM_MAGAZINE_SIZE * 8)
+
+struct kmem_magazine {
+	struct kmem_cache	*s;
+	struct list_head	list;
+	unsigned		nr;
+	void			*objs[KMEM_MAGAZINE_SIZE];
+};
+
+struct kmem_cache {
+	const char		*name;
+	size_t			size;
+	size_t			align;
+	void			(*ctor)(void *);
+
+	pthread_key_t		key;
+
+	struct mutex		lock;
+	struct list_head	magazines;
+	unsigned		depot_nr;
+	void			*depot[KMEM_DEPOT_SIZE];
+
+	struct shrinker		shrink;
+};
+
+static void *kmem_obj_new(struct kmem_cache *s)
+{
+	void *p;
+
+	run_shrinkers();
+
+	if (posix_memalign(&p, s->align, s->size))
+		return NULL;
+
+	if (s->ctor)
+		s->ctor(p);
+	return p;
+}
+
+/* Move @nr objects from the bottom (coldest end) of @m to the depot: */
+static void kmem_magazine_drain(struct kmem_cache *s, struct kmem_magazine *m,
+				unsigned nr)
+{
+	unsigned i, n;
+
+	mutex_lock(&s->lock);
+	n = min_t(unsigned, nr, KMEM_DEPOT_SIZE - s->depot_nr);
+	memcpy(s->depot + s->depot_nr, m->objs, n * sizeof(void *));
+	s->depot_nr += n;
+	mutex_unlock(&s->lock);
+
+	for (i = n; i < nr; i++)
+		free(m->objs[i]);
+
+	m->nr -= nr;
+	memmove(m->objs, m->objs + nr, m->nr * sizeof(void *));
+}
+
+static unsigned kmem_magazine_refill(struct kmem_cache *s,
+				     struct kmem_magazine *m)
+{
+	unsigned n;
+
+	mutex_lock(&s->lock);
+	n = min_t(unsigned, s->depot_nr, KMEM_BATCH);
+	s->depot_nr -= n;
+	memcpy(m->objs, s->depot + s->depot_nr, n * sizeof(void *));
+	mutex_unlock(&s->lock);
+
+	m->nr = n;
+	return n;
+}
+
+/* pthread key destructor, called on thread exit: */
+static void kmem_magazine_release(void *p)
+{
+	struct kmem_magazine *m = p;
+	struct kmem_cache *s = m->s;
+
+	kmem_magazine_drain(s, m, m->nr);
+
+	mutex_lock(&s->lock);
+	list_del(&m->list);
+	mutex_unlock(&s->lock);
+
+	free(m);
+}
+
+static struct kmem_magazine *kmem_magazine_get(struct kmem_cache *s)
+{
+	struct kmem_magazine *m = pthread_getspecific(s->key);
+
+	if (likely(m))
+		return m;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+
+	m->s = s;
+
+	mutex_lock(&s->lock);
+	list_add(&m->list, &s->magazines);
+	mutex_unlock(&s->lock);
+
+	pthread_setspecific(s->key, m);
+	return m;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *s, gfp_t flags)
+{
+	struct kmem_magazine *m = kmem_magazine_get(s);
+	void *p;
+
+	if (likely(m) && (m->nr || kmem_magazine_refill(s, m))) {
+		p = m->objs[--m->nr];
+	} else {
+		p = kmem_obj_new(s);
+		if (!p)
+			return NULL;
+	}
+
+	if (flags & __GFP_ZERO)
+		memset(p, 0, s->size);
+	return p;
+}
+
+void kmem_cache_free(struct kmem_cache *s, void *p)
+{
+	struct kmem_magazine *m;
+
+	if (unlikely(!p))
+		return;
+
+	m = kmem_magazine_get(s);
+	if (unlikely(!m)) {
+		free(p);
+		return;
+	}
+
+	if (unlikely(m->nr == KMEM_MAGAZINE_SIZE))
+		kmem_magazine_drain(s, m, KMEM_BATCH);
+
+	m->objs[m->nr++] = p;
+}
+
+static unsigned long kmem_cache_shrink_count(struct shrinker *shrink,
+					     struct shrink_control *sc)
+{
+	struct kmem_cache *s = container_of(shrink, struct kmem_cache, shrink);
+
+	return READ_ONCE(s->depot_nr);
+}
+
+static unsigned long kmem_cache_shrink_scan(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	struct kmem_cache *s = container_of(shrink, struct kmem_cache, shrink);
+	unsigned long freed = 0;
+
+	mutex_lock(&s->lock);
+	while (s->depot_nr) {
+		free(s->depot[--s->depot_nr]);
+		freed++;
+	}
+	mutex_unlock(&s->lock);
+
+	return freed;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, unsigned long flags,
+				     void (*ctor)(void *))
+{
+	struct kmem_cache *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		goto err;
+
+	if (flags & SLAB_HWCACHE_ALIGN)
+		align = max_t(size_t, align, L1_CACHE_BYTES);
+
+	s->name		= name;
+	s->size		= max_t(size_t, size, 1);
+	s->align	= roundup_pow_of_two(max(align, sizeof(void *)));
+	s->ctor		= ctor;
+	mutex_init(&s->lock);
+	INIT_LIST_HEAD(&s->magazines);
+
+	if (pthread_key_create(&s->key, kmem_magazine_release)) {
+		free(s);
+		goto err;
+	}
+
+	s->shrink.count_objects	= kmem_cache_shrink_count;
+	s->shrink.scan_objects	= kmem_cache_shrink_scan;
+	register_shrinker(&s->shrink);
+
+	return s;
+err:
+	BUG_ON(flags & SLAB_PANIC);
+	return NULL;
+}
+
+/*
+ * As in the kernel, the cache must be idle when it's destroyed: objects still
+ * sitting in other threads' magazines are freed along with it.
+ */
+void kmem_cache_destroy(struct kmem_cache *s)
+{
+	struct kmem_magazine *m, *n;
+
+	if (!s)
+		return;
+
+	unregister_shrinker(&s->shrink);
+	pthread_key_delete(s->key);
+
+	list_for_each_entry_safe(m, n, &s->magazines, list) {
+		while (m->nr)
+			free(m->objs[--m->nr]);
+		free(m);
+	}
+
+	while (s->depot_nr)
+		free(s->depot[--s->depot_nr]);
+
+	free(s);
+}
@@ -0,0 +1,81 @@
+#include <linux/futex.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+
+/* spin for at most ~2 * SPIN_BACKOFF_MAX cpu_relax()es before sleeping: */
+#define SPIN_BACKOFF_MAX	128
+
+#ifdef CONFIG_LOCK_STAT
+static struct spin_lock_site *lock_sites;
+
+static void lock_site_register(struct spin_lock_site *site)
+{
+	struct spin_lock_site *old, *v = READ_ONCE(lock_sites);
+
+	if (READ_ONCE(site->registered) || xchg(&site->registered, 1))
+		return;
+
+	do {
+		old = v;
+		site->next = old;
+	} while ((v = cmpxchg(&lock_sites, old, site)) != old);
+}
+
+__attribute__((destructor))
+static void lock_stat_print(void)
+{
+	struct spin_lock_site *site;
+
+	for (site = READ_ONCE(lock_sites); site; site = site->next)
+		fprintf(stderr, "%s:%u: acquired %llu contended %llu slept %llu\n",
+			site->file, site->line,
+			site->acquired, site->contended, site->slept);
+}
+
+#define lock_stat_inc(site, field)					\
+do {									\
+	if (site)							\
+		__atomic_add_fetch(&(site)->field, 1, __ATOMIC_RELAXED);\
+} while (0)
+#else
+static inline void lock_site_register(struct spin_lock_site *site) {}
+#define lock_stat_inc(site, field)	do {} while (0)
+#endif
+
+void __raw_spin_lock_slowpath(raw_spinlock_t *lock, struct spin_lock_site *site)
+{
+	unsigned i, backoff;
+
+	if (site) {
+		lock_site_register(site);
+		lock_stat_inc(site, contended);
+	}
+
+	for (backoff = 1; backoff <= SPIN_BACKOFF_MAX; backoff <<= 1) {
+		for (i = 0; i < backoff; i++)
+			cpu_relax();
+
+		if (!READ_ONCE(lock->count) &&
+		    !cmpxchg_acquire(&lock->count, 0, 1))
+			return;
+	}
+
+	/*
+	 * Taking the lock here marks it contended, so we might do a spurious
+	 * wakeup on unlock - but we can't know if there are other waiters:
+	 */
+	while (xchg_acquire(&lock->count, 2)) {
+		lock_stat_inc(site, slept);
+		syscall(SYS_futex, &lock->count, FUTEX_WAIT_PRIVATE,
+			2, NULL, NULL, 0);
+	}
+}
+
+void __raw_spin_unlock_wake(raw_spinlock_t *lock)
+{
+	syscall(SYS_futex, &lock->count, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
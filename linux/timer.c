@@ -45,7 +45,15 @@ do {									\
 	(heap)->data = NULL;						\
 } while (0)
 
-#define heap_swap(h, i, j)	swap((h)->data[i], (h)->data[j])
+/* pending timers know their heap index, so lookups are O(1): */
+#define heap_set_idx(h, i)	((h)->data[i].timer->idx = (i))
+
+#define heap_swap(h, i, j)						\
+do {									\
+	swap((h)->data[i], (h)->data[j]);				\
+	heap_set_idx(h, i);						\
+	heap_set_idx(h, j);						\
+} while (0)
 
 #define heap_sift(h, i, cmp)						\
 do {									\
@@ -54,10 +62,10 @@ do {									\
 	for (; _j * 2 + 1 < (h)->used; _j = _r) {			\
 		_r = _j * 2 + 1;					\
 		if (_r + 1 < (h)->used &&				\
-		    cmp((h)->data[_r], (h)->data[_r + 1]))		\
+		    cmp((h)->data[_r + 1], (h)->data[_r]))		\
 			_r++;						\
 									\
-		if (cmp((h)->data[_r], (h)->data[_j]))			\
+		if (!cmp((h)->data[_r], (h)->data[_j]))			\
 			break;						\
 		heap_swap(h, _r, _j);					\
 	}								\
@@ -67,7 +75,7 @@ do {									\
 do {									\
 	while (i) {							\
 		size_t p = (i - 1) / 2;					\
-		if (cmp((h)->data[i], (h)->data[p]))			\
+		if (!cmp((h)->data[i], (h)->data[p]))			\
 			break;						\
 		heap_swap(h, i, p);					\
 		i = p;							\
@@ -80,6 +88,7 @@ do {									\
 	if (_r) {							\
 		size_t _i = (h)->used++;				\
 		(h)->data[_i] = d;					\
+		heap_set_idx(h, _i);					\
 									\
 		heap_sift_down(h, _i, cmp);				\
 		heap_sift(h, _i, cmp);					\
@@ -93,9 +102,11 @@ do {									\
 									\
 	BUG_ON(_i >= (h)->used);					\
 	(h)->used--;							\
-	heap_swap(h, _i, (h)->used);					\
-	heap_sift_down(h, _i, cmp);					\
-	heap_sift(h, _i, cmp);						\
+	if (_i < (h)->used) {						\
+		heap_swap(h, _i, (h)->used);				\
+		heap_sift_down(h, _i, cmp);				\
+		heap_sift(h, _i, cmp);					\
+	}								\
 } while (0)
 
 #define heap_pop(h, d, cmp)						\
@@ -144,13 +155,12 @@ static inline bool timer_running(void)
 
 static ssize_t timer_idx(struct timer_list *timer)
 {
-	size_t i;
-
-	for (i = 0; i < pending_timers.used; i++)
-		if (pending_timers.data[i].timer == timer)
-			return i;
+	if (!timer->pending)
+		return -1;
 
-	return -1;
+	BUG_ON(timer->idx >= pending_timers.used ||
+	       pending_timers.data[timer->idx].timer != timer);
+	return timer->idx;
 }
 
 int del_timer(struct timer_list *timer)
@@ -205,9 +215,9 @@ int mod_timer(struct timer_list *timer, unsigned long expires)
 	ssize_t idx;
 
 	pthread_mutex_lock(&timer_lock);
+	idx = timer_idx(timer);
 	timer->expires = expires;
 	timer->pending = true;
-	idx = timer_idx(timer);
 
 	if (idx >= 0 &&
 	    pending_timers.data[idx].expires == expires)
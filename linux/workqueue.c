@@ -1,24 +1,93 @@
 #include <pthread.h>
+#include <sched.h>
 
+#include <linux/cpumask.h>
+#include <linux/hash.h>
 #include <linux/kthread.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
 
-static pthread_mutex_t	wq_lock = PTHREAD_MUTEX_INITIALIZER;
-static LIST_HEAD(wq_list);
+/*
+ * All workqueues share one pool of workers.
+ *
+ * Queueing a work item first goes through its workqueue's max_active limit:
+ * past that, items wait on the workqueue's inactive list. Active items go on
+ * the local list of the worker queueing them, or on the pool's shared list
+ * when queued from outside the pool or on a WQ_UNBOUND workqueue. Idle
+ * workers steal from other workers' local lists.
+ *
+ * We can't tell when a worker blocks, so the pool grows when work is waiting
+ * and no worker is idle: immediately up to WORKER_EAGER_PER_CPU workers per
+ * cpu, and past that only when no work item has completed for
+ * WORKER_MAYDAY_INTERVAL - so that work items waiting on other work items
+ * can't deadlock. Workers idle for WORKER_IDLE_TIMEOUT exit, down to one per
+ * cpu.
+ */
+
+#define WORKER_EAGER_PER_CPU	2
+#define WORKER_MAYDAY_INTERVAL	(HZ / 50)
+#define WORKER_IDLE_TIMEOUT	(5 * HZ)
+#define BUSY_HASH_BITS		6
+
+struct work_list {
+	spinlock_t		lock;
+	struct list_head	items;
+};
 
 struct workqueue_struct {
+	unsigned		flags;
+	int			max_active;
+
+	/* inactive.lock also protects nr_active: */
+	int			nr_active;
+	struct work_list	inactive;
+
+	char			name[24];
+};
+
+struct worker {
 	struct list_head	list;
+	struct list_head	idle;
+	struct task_struct	*task;
+	struct work_list	local;
 
+	/* protected by the busy hash bucket lock: */
+	struct hlist_node	hentry;
 	struct work_struct	*current_work;
-	struct list_head	pending_work;
-
-	pthread_cond_t		work_finished;
+	bool			rerun;
+};
 
-	struct task_struct	*worker;
-	char			name[24];
+struct busy_bucket {
+	spinlock_t		lock;
+	struct hlist_head	workers;
 };
 
+static struct {
+	/* protects workers, idle, nr_workers, nr_idle: */
+	spinlock_t		lock;
+	struct list_head	workers;
+	struct list_head	idle;
+	unsigned		nr_workers;
+	unsigned		nr_idle;
+	unsigned		next_id;
+
+	struct work_list	shared;
+	/* items on the shared list and workers' local lists: */
+	atomic_t		nr_pending;
+	atomic_long_t		nr_completed;
+
+	struct task_struct	*manager;
+
+	struct busy_bucket	busy_hash[1 << BUSY_HASH_BITS];
+
+	/* flush and destroy_workqueue() wait here: */
+	wait_queue_head_t	done_wait;
+} pool;
+
+static __thread struct worker *current_worker;
+
 enum {
 	WORK_PENDING_BIT,
 };
@@ -33,24 +102,128 @@ static bool set_work_pending(struct work_struct *work)
 	return !test_and_set_bit(WORK_PENDING_BIT, work_data_bits(work));
 }
 
+static void work_list_init(struct work_list *l)
+{
+	spin_lock_init(&l->lock);
+	INIT_LIST_HEAD(&l->items);
+}
+
+static void work_list_add(struct work_list *l, struct work_struct *work)
+{
+	spin_lock(&l->lock);
+	BUG_ON(!list_empty(&work->entry));
+	list_add_tail(&work->entry, &l->items);
+	work->list = l;
+	spin_unlock(&l->lock);
+}
+
+static struct work_struct *work_list_pop(struct work_list *l)
+{
+	struct work_struct *work;
+
+	if (list_empty_careful(&l->items))
+		return NULL;
+
+	spin_lock(&l->lock);
+	work = list_first_entry_or_null(&l->items, struct work_struct, entry);
+	if (work) {
+		list_del_init(&work->entry);
+		work->list = NULL;
+	}
+	spin_unlock(&l->lock);
+
+	return work;
+}
+
+static void wake_done_waiters(void)
+{
+	smp_mb();
+	if (unlikely(!list_empty_careful(&pool.done_wait.task_list)))
+		wake_up(&pool.done_wait);
+}
+
+static void kick_worker(void)
+{
+	struct worker *w = NULL;
+
+	/* pairs with the barrier in worker_thread() before it sleeps: */
+	smp_mb();
+
+	if (READ_ONCE(pool.nr_idle)) {
+		spin_lock(&pool.lock);
+		w = list_first_entry_or_null(&pool.idle, struct worker, idle);
+		if (w) {
+			list_del_init(&w->idle);
+			pool.nr_idle--;
+			wake_up_process(w->task);
+		}
+		spin_unlock(&pool.lock);
+	}
+
+	if (!w && READ_ONCE(pool.manager->state) != TASK_RUNNING)
+		wake_up_process(pool.manager);
+}
+
+static void work_activate(struct workqueue_struct *wq, struct work_struct *work)
+{
+	struct worker *w = current_worker;
+
+	work_list_add(w && !(wq->flags & WQ_UNBOUND)
+		      ? &w->local
+		      : &pool.shared, work);
+	atomic_inc(&pool.nr_pending);
+	kick_worker();
+}
+
+/* A work item from @wq finished or was cancelled: */
+static void wq_dec_nr_active(struct workqueue_struct *wq)
+{
+	struct work_struct *next;
+
+	spin_lock(&wq->inactive.lock);
+	next = list_first_entry_or_null(&wq->inactive.items,
+					struct work_struct, entry);
+	if (next) {
+		list_del_init(&next->entry);
+		next->list = NULL;
+	} else {
+		wq->nr_active--;
+	}
+	spin_unlock(&wq->inactive.lock);
+
+	if (next)
+		work_activate(wq, next);
+	else
+		wake_done_waiters();
+}
+
 static void __queue_work(struct workqueue_struct *wq,
 			 struct work_struct *work)
 {
 	BUG_ON(!test_bit(WORK_PENDING_BIT, work_data_bits(work)));
 	BUG_ON(!list_empty(&work->entry));
 
-	list_add_tail(&work->entry, &wq->pending_work);
-	wake_up_process(wq->worker);
+	work->wq = wq;
+
+	spin_lock(&wq->inactive.lock);
+	if (wq->nr_active >= wq->max_active) {
+		list_add_tail(&work->entry, &wq->inactive.items);
+		work->list = &wq->inactive;
+		spin_unlock(&wq->inactive.lock);
+		return;
+	}
+	wq->nr_active++;
+	spin_unlock(&wq->inactive.lock);
+
+	work_activate(wq, work);
 }
 
 bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
 {
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	if ((ret = set_work_pending(work)))
 		__queue_work(wq, work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -59,9 +232,7 @@ void delayed_work_timer_fn(unsigned long __data)
 {
 	struct delayed_work *dwork = (struct delayed_work *) __data;
 
-	pthread_mutex_lock(&wq_lock);
 	__queue_work(dwork->wq, &dwork->work);
-	pthread_mutex_unlock(&wq_lock);
 }
 
 static void __queue_delayed_work(struct workqueue_struct *wq,
@@ -92,16 +263,50 @@ bool queue_delayed_work(struct workqueue_struct *wq,
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	if ((ret = set_work_pending(work)))
 		__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
 
+static struct busy_bucket *busy_bucket(struct work_struct *work)
+{
+	return &pool.busy_hash[hash_ptr(work, BUSY_HASH_BITS)];
+}
+
+static struct worker *find_worker_executing_work(struct busy_bucket *b,
+						 struct work_struct *work)
+{
+	struct worker *w;
+
+	hlist_for_each_entry(w, &b->workers, hentry)
+		if (w->current_work == work)
+			return w;
+	return NULL;
+}
+
+static bool work_executing(struct work_struct *work)
+{
+	struct busy_bucket *b = busy_bucket(work);
+	bool ret;
+
+	spin_lock(&b->lock);
+	ret = find_worker_executing_work(b, work) != NULL;
+	spin_unlock(&b->lock);
+
+	return ret;
+}
+
+/*
+ * Steal a pending work item back: on success, the caller owns the pending bit
+ * and the work item is neither queued nor going to be run.
+ */
 static bool grab_pending(struct work_struct *work, bool is_dwork)
 {
+	struct work_list *l;
+	struct busy_bucket *b;
+	struct worker *w;
+	bool ret;
 retry:
 	if (set_work_pending(work)) {
 		BUG_ON(!list_empty(&work->entry));
@@ -117,44 +322,61 @@ retry:
 		}
 	}
 
-	if (!list_empty(&work->entry)) {
-		list_del_init(&work->entry);
-		return true;
+	l = READ_ONCE(work->list);
+	if (l) {
+		spin_lock(&l->lock);
+		ret = work->list == l;
+		if (ret) {
+			list_del_init(&work->entry);
+			work->list = NULL;
+		}
+		spin_unlock(&l->lock);
+
+		if (ret) {
+			if (l != &work->wq->inactive) {
+				atomic_dec(&pool.nr_pending);
+				wq_dec_nr_active(work->wq);
+			}
+			return true;
+		}
 	}
 
-	BUG_ON(!is_dwork);
+	/* queued again while running, to be rerun by the same worker? */
+	b = busy_bucket(work);
+	spin_lock(&b->lock);
+	w = find_worker_executing_work(b, work);
+	ret = w && w->rerun;
+	if (ret)
+		w->rerun = false;
+	spin_unlock(&b->lock);
+
+	if (ret) {
+		wq_dec_nr_active(work->wq);
+		return true;
+	}
 
-	pthread_mutex_unlock(&wq_lock);
-	flush_timers();
-	pthread_mutex_lock(&wq_lock);
+	/* in flight between a timer, a list and a worker: */
+	sched_yield();
 	goto retry;
 }
 
 static bool __flush_work(struct work_struct *work)
 {
-	struct workqueue_struct *wq;
-	bool ret = false;
-retry:
-	list_for_each_entry(wq, &wq_list, list)
-		if (wq->current_work == work) {
-			pthread_cond_wait(&wq->work_finished, &wq_lock);
-			ret = true;
-			goto retry;
-		}
+	if (!work_executing(work))
+		return false;
 
-	return ret;
+	wait_event(pool.done_wait, !work_executing(work));
+	return true;
 }
 
 bool cancel_work_sync(struct work_struct *work)
 {
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	ret = grab_pending(work, false);
 
 	__flush_work(work);
 	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -166,11 +388,9 @@ bool mod_delayed_work(struct workqueue_struct *wq,
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	ret = grab_pending(work, true);
 
 	__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -180,11 +400,9 @@ bool cancel_delayed_work(struct delayed_work *dwork)
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	ret = grab_pending(work, true);
 
 	clear_work_pending(&dwork->work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -194,62 +412,206 @@ bool cancel_delayed_work_sync(struct delayed_work *dwork)
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	ret = grab_pending(work, true);
 
 	__flush_work(work);
 	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
 
+static void process_one_work(struct worker *w, struct work_struct *work)
+{
+	struct busy_bucket *b = busy_bucket(work);
+	struct workqueue_struct *wq;
+	struct worker *collision;
+
+	/*
+	 * Work items are non reentrant: if it's still running elsewhere, have
+	 * that worker run it again when it's done:
+	 */
+	spin_lock(&b->lock);
+	collision = find_worker_executing_work(b, work);
+	if (unlikely(collision)) {
+		BUG_ON(collision->rerun);
+		collision->rerun = true;
+		spin_unlock(&b->lock);
+		return;
+	}
+
+	w->current_work = work;
+	hlist_add_head(&w->hentry, &b->workers);
+	do {
+		w->rerun = false;
+		spin_unlock(&b->lock);
+
+		/* the work item may free itself: */
+		wq = work->wq;
+
+		BUG_ON(!test_bit(WORK_PENDING_BIT, work_data_bits(work)));
+		clear_work_pending(work);
+		smp_mb__after_atomic();
+
+		work->func(work);
+
+		wq_dec_nr_active(wq);
+		atomic_long_inc(&pool.nr_completed);
+
+		spin_lock(&b->lock);
+	} while (w->rerun);
+
+	hlist_del_init(&w->hentry);
+	w->current_work = NULL;
+	spin_unlock(&b->lock);
+
+	wake_done_waiters();
+}
+
+static struct work_struct *worker_get_work(struct worker *w)
+{
+	struct work_struct *work;
+	struct worker *victim;
+
+	work = work_list_pop(&w->local) ?: work_list_pop(&pool.shared);
+	if (!work && atomic_read(&pool.nr_pending)) {
+		spin_lock(&pool.lock);
+		list_for_each_entry(victim, &pool.workers, list)
+			if (victim != w &&
+			    (work = work_list_pop(&victim->local)))
+				break;
+		spin_unlock(&pool.lock);
+	}
+
+	if (work)
+		atomic_dec(&pool.nr_pending);
+	return work;
+}
+
+/* returns true if this worker should exit: */
+static bool worker_idle(struct worker *w)
+{
+	bool timed_out, exit = false;
+
+	set_current_state(TASK_INTERRUPTIBLE);
+
+	spin_lock(&pool.lock);
+	list_add(&w->idle, &pool.idle);
+	pool.nr_idle++;
+	spin_unlock(&pool.lock);
+
+	/* pairs with the barrier in kick_worker(): */
+	smp_mb();
+
+	timed_out = !atomic_read(&pool.nr_pending) &&
+		!schedule_timeout(WORKER_IDLE_TIMEOUT);
+	__set_current_state(TASK_RUNNING);
+
+	spin_lock(&pool.lock);
+	if (!list_empty(&w->idle)) {
+		list_del_init(&w->idle);
+		pool.nr_idle--;
+
+		exit = timed_out &&
+			pool.nr_workers > num_possible_cpus() &&
+			list_empty_careful(&w->local.items);
+		if (exit) {
+			list_del(&w->list);
+			pool.nr_workers--;
+		}
+	}
+	spin_unlock(&pool.lock);
+
+	return exit;
+}
+
 static int worker_thread(void *arg)
 {
-	struct workqueue_struct *wq = arg;
+	struct worker *w = arg;
 	struct work_struct *work;
 
-	pthread_mutex_lock(&wq_lock);
-	while (1) {
-		__set_current_state(TASK_INTERRUPTIBLE);
-		work = list_first_entry_or_null(&wq->pending_work,
-				struct work_struct, entry);
-		wq->current_work = work;
+	current_worker = w;
 
-		if (kthread_should_stop()) {
-			BUG_ON(wq->current_work);
+	while (1) {
+		work = worker_get_work(w);
+		if (work)
+			process_one_work(w, work);
+		else if (worker_idle(w))
 			break;
-		}
+	}
 
-		if (!work) {
-			pthread_mutex_unlock(&wq_lock);
-			schedule();
-			pthread_mutex_lock(&wq_lock);
-			continue;
-		}
+	kfree(w);
+	return 0;
+}
 
-		BUG_ON(!test_bit(WORK_PENDING_BIT, work_data_bits(work)));
-		list_del_init(&work->entry);
-		clear_work_pending(work);
+static void create_worker(void)
+{
+	struct worker *w = kzalloc(sizeof(*w), GFP_KERNEL);
+	struct task_struct *p;
+	unsigned id;
+
+	if (!w)
+		return;
+
+	INIT_LIST_HEAD(&w->idle);
+	INIT_HLIST_NODE(&w->hentry);
+	work_list_init(&w->local);
+
+	spin_lock(&pool.lock);
+	list_add_tail(&w->list, &pool.workers);
+	pool.nr_workers++;
+	id = pool.next_id++;
+	spin_unlock(&pool.lock);
+
+	p = kthread_create(worker_thread, w, "kworker/%u", id);
+	if (IS_ERR(p)) {
+		spin_lock(&pool.lock);
+		list_del(&w->list);
+		pool.nr_workers--;
+		spin_unlock(&pool.lock);
+		kfree(w);
+		return;
+	}
 
-		pthread_mutex_unlock(&wq_lock);
-		work->func(work);
-		pthread_mutex_lock(&wq_lock);
+	w->task = p;
+	wake_up_process(p);
+}
+
+static int manager_thread(void *arg)
+{
+	long completed = atomic_long_read(&pool.nr_completed);
+	unsigned nr_workers;
+	bool stalled;
 
-		pthread_cond_broadcast(&wq->work_finished);
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		nr_workers = READ_ONCE(pool.nr_workers);
+
+		if (atomic_read(&pool.nr_pending) &&
+		    !READ_ONCE(pool.nr_idle) &&
+		    nr_workers < WQ_MAX_ACTIVE) {
+			stalled = atomic_long_read(&pool.nr_completed) == completed;
+			completed = atomic_long_read(&pool.nr_completed);
+
+			if (nr_workers < WORKER_EAGER_PER_CPU * num_possible_cpus() ||
+			    stalled) {
+				__set_current_state(TASK_RUNNING);
+				create_worker();
+				continue;
+			}
+
+			schedule_timeout(WORKER_MAYDAY_INTERVAL);
+		} else {
+			schedule();
+		}
 	}
-	pthread_mutex_unlock(&wq_lock);
 
 	return 0;
 }
 
 void destroy_workqueue(struct workqueue_struct *wq)
 {
-	kthread_stop(wq->worker);
-
-	pthread_mutex_lock(&wq_lock);
-	list_del(&wq->list);
-	pthread_mutex_unlock(&wq_lock);
+	wait_event(pool.done_wait, !READ_ONCE(wq->nr_active));
 
 	kfree(wq);
 }
@@ -266,25 +628,20 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 	if (!wq)
 		return NULL;
 
-	INIT_LIST_HEAD(&wq->list);
-	INIT_LIST_HEAD(&wq->pending_work);
+	if (flags & __WQ_ORDERED)
+		max_active = 1;
 
-	pthread_cond_init(&wq->work_finished, NULL);
+	wq->flags	= flags;
+	wq->max_active	= clamp_t(int, max_active ?: WQ_DFL_ACTIVE, 1,
+				  flags & WQ_UNBOUND
+				  ? WQ_UNBOUND_MAX_ACTIVE
+				  : WQ_MAX_ACTIVE);
+	work_list_init(&wq->inactive);
 
 	va_start(args, max_active);
 	vsnprintf(wq->name, sizeof(wq->name), fmt, args);
 	va_end(args);
 
-	wq->worker = kthread_run(worker_thread, wq, "%s", wq->name);
-	if (IS_ERR(wq->worker)) {
-		kfree(wq);
-		return NULL;
-	}
-
-	pthread_mutex_lock(&wq_lock);
-	list_add(&wq->list, &wq_list);
-	pthread_mutex_unlock(&wq_lock);
-
 	return wq;
 }
 
@@ -294,9 +651,29 @@ struct workqueue_struct *system_long_wq;
 struct workqueue_struct *system_unbound_wq;
 struct workqueue_struct *system_freezable_wq;
 
-__attribute__((constructor(102)))
+/* after timers_init(): idle workers sleep with schedule_timeout() */
+__attribute__((constructor(104)))
 static void wq_init(void)
 {
+	unsigned i, cpu;
+
+	spin_lock_init(&pool.lock);
+	INIT_LIST_HEAD(&pool.workers);
+	INIT_LIST_HEAD(&pool.idle);
+	work_list_init(&pool.shared);
+	init_waitqueue_head(&pool.done_wait);
+
+	for (i = 0; i < ARRAY_SIZE(pool.busy_hash); i++) {
+		spin_lock_init(&pool.busy_hash[i].lock);
+		INIT_HLIST_HEAD(&pool.busy_hash[i].workers);
+	}
+
+	pool.manager = kthread_run(manager_thread, NULL, "kworker_manager");
+	BUG_ON(IS_ERR(pool.manager));
+
+	for_each_possible_cpu(cpu)
+		create_worker();
+
 	system_wq = alloc_workqueue("events", 0, 0);
 	system_highpri_wq = alloc_workqueue("events_highpri", WQ_HIGHPRI, 0);
 	system_long_wq = alloc_workqueue("events_long", 0, 0);
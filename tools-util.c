@@ -17,6 +17,8 @@
 #include <blkid.h>
 #include <uuid/uuid.h>
 
+#include <asm/unaligned.h>
+
 #include "libbcachefs/bcachefs_ioctl.h"
 #include "linux/sort.h"
 #include "tools-util.h"
@@ -491,10 +493,53 @@ static u32 crc32c_default(u32 crc, const void *buf, size_t size)
 	return crc;
 }
 
+#define CRC32C_POLY	0x82F63B78	/* reflected */
+
+/* a * b mod P, reflected: */
+static u32 crc32c_mulmod(u32 a, u32 b)
+{
+	u32 r = 0, m;
+
+	for (m = 1U << 31; m; m >>= 1) {
+		if (a & m)
+			r ^= b;
+		b = (b >> 1) ^ (b & 1 ? CRC32C_POLY : 0);
+	}
+
+	return r;
+}
+
+/* x^(2^i) mod P: */
+static u32 crc32c_x2n[64];
+
+/* x^n mod P, reflected: */
+static u32 crc32c_xpow(u64 n)
+{
+	u32 r = 1U << 31;		/* x^0 */
+	unsigned i;
+
+	for (i = 0; n; i++, n >>= 1)
+		if (n & 1)
+			r = crc32c_mulmod(r, crc32c_x2n[i]);
+
+	return r;
+}
+
+/*
+ * Returns the crc of the original data followed by @len zero bytes, in
+ * O(log len) - for combining crcs of adjacent buffers:
+ */
+u32 __crc32c_le_shift(u32 crc, size_t len)
+{
+	return crc32c_mulmod(crc, crc32c_xpow((u64) len * 8));
+}
+
 #include <linux/compiler.h>
 
 #ifdef __x86_64__
 
+#include <immintrin.h>
+
 #ifdef CONFIG_X86_64
 #define REX_PRE "0x48, "
 #else
@@ -530,11 +575,104 @@ static u32 crc32c_sse42(u32 crc, const void *buf, size_t size)
 	return crc;
 }
 
+/*
+ * crc32 has a latency of 3 cycles but a throughput of 1 per cycle, so for big
+ * buffers we run three independent streams, then shift the first two partial
+ * crcs past the data that followed them and combine. Shifting a crc by n bits
+ * is a multiply by x^n mod P: a carry-less multiply by a precomputed power of
+ * x, then reduced with the crc32 instruction.
+ */
+#define CRC32C_LONG	1024
+#define CRC32C_SHORT	128
+
+/* shift constants for 2 * LONG, LONG, 2 * SHORT, SHORT bytes: */
+static u64 crc32c_shift_k[4];
+
+static __attribute__((target("sse4.2,pclmul")))
+u32 crc32c_shift_clmul(u32 crc, u64 k)
+{
+	__m128i t = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+					 _mm_cvtsi64_si128(k), 0x00);
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(t));
+}
+
+#define crc32c_3way(crc, p, size, len, k_2len, k_len)			\
+do {									\
+	while (size >= 3 * (len)) {					\
+		const u64 *d = (const u64 *) p;				\
+		u64 crc0 = crc, crc1 = 0, crc2 = 0;			\
+		unsigned i;						\
+									\
+		for (i = 0; i < (len) / 8; i++) {			\
+			crc0 = _mm_crc32_u64(crc0, d[i]);		\
+			crc1 = _mm_crc32_u64(crc1, d[i + (len) / 8]);	\
+			crc2 = _mm_crc32_u64(crc2, d[i + (len) / 4]);	\
+		}							\
+									\
+		crc = crc32c_shift_clmul(crc0, k_2len) ^		\
+			crc32c_shift_clmul(crc1, k_len) ^ crc2;		\
+		p	+= 3 * (len);					\
+		size	-= 3 * (len);					\
+	}								\
+} while (0)
+
+static __attribute__((target("sse4.2,pclmul")))
+u32 crc32c_sse42_pclmul(u32 crc, const void *buf, size_t size)
+{
+	const u8 *p = buf;
+	u64 crc64;
+
+	crc32c_3way(crc, p, size, CRC32C_LONG,
+		    crc32c_shift_k[0], crc32c_shift_k[1]);
+	crc32c_3way(crc, p, size, CRC32C_SHORT,
+		    crc32c_shift_k[2], crc32c_shift_k[3]);
+
+	/* a u64 accumulator keeps zero extension out of the dependency chain: */
+	crc64 = crc;
+	for (; size >= 8; p += 8, size -= 8)
+		crc64 = _mm_crc32_u64(crc64, get_unaligned((const u64 *) p));
+	crc = crc64;
+
+	for (; size; p++, size--)
+		crc = _mm_crc32_u8(crc, *p);
+
+	return crc;
+}
+
+#endif /* __x86_64__ */
+
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+	unsigned i;
+
+	crc32c_x2n[0] = 1U << 30;	/* x^1, reflected */
+	for (i = 1; i < ARRAY_SIZE(crc32c_x2n); i++)
+		crc32c_x2n[i] = crc32c_mulmod(crc32c_x2n[i - 1],
+					      crc32c_x2n[i - 1]);
+
+#ifdef __x86_64__
+	/*
+	 * The constant for shifting by n bits is x^(n - 33) mod P: the crc32
+	 * instruction multiplies by x^32, and a carry-less multiply of two
+	 * reflected values comes out multiplied by x^-1.
+	 */
+	crc32c_shift_k[0] = crc32c_xpow(2 * CRC32C_LONG * 8 - 33);
+	crc32c_shift_k[1] = crc32c_xpow(CRC32C_LONG * 8 - 33);
+	crc32c_shift_k[2] = crc32c_xpow(2 * CRC32C_SHORT * 8 - 33);
+	crc32c_shift_k[3] = crc32c_xpow(CRC32C_SHORT * 8 - 33);
+#endif
+}
+
 static void *resolve_crc32c(void)
 {
 	__builtin_cpu_init();
 
 #ifdef __x86_64__
+	if (__builtin_cpu_supports("sse4.2") &&
+	    __builtin_cpu_supports("pclmul"))
+		return crc32c_sse42_pclmul;
 	if (__builtin_cpu_supports("sse4.2"))
 		return crc32c_sse42;
 #endif
@@ -563,6 +701,210 @@ u32 crc32c(u32 crc, const void *buf, size_t size)
 
 #endif /* HAVE_WORKING_IFUNC */
 
+/* crc64 */
+
+/*
+ * The ECMA-182 polynomial, not reflected - as used by bch2_checksum().
+ *
+ * The portable version is slicing by 8: crc64_tab[n] advances the crc past a
+ * byte followed by n zero bytes.
+ */
+#define CRC64_POLY	0x42F0E1EBA9EA3693ULL
+
+static u64 crc64_tab[8][256];
+
+static u64 crc64_default(u64 crc, const void *buf, size_t size)
+{
+	const u8 *p = buf;
+
+	while (size >= 8) {
+		crc ^= get_unaligned_be64(p);
+		crc =	crc64_tab[7][crc >> 56] ^
+			crc64_tab[6][(crc >> 48) & 0xff] ^
+			crc64_tab[5][(crc >> 40) & 0xff] ^
+			crc64_tab[4][(crc >> 32) & 0xff] ^
+			crc64_tab[3][(crc >> 24) & 0xff] ^
+			crc64_tab[2][(crc >> 16) & 0xff] ^
+			crc64_tab[1][(crc >>  8) & 0xff] ^
+			crc64_tab[0][crc & 0xff];
+		p	+= 8;
+		size	-= 8;
+	}
+
+	while (size--)
+		crc = crc64_tab[0][(crc >> 56) ^ *p++] ^ (crc << 8);
+
+	return crc;
+}
+
+#ifdef __x86_64__
+
+/*
+ * Carry-less multiply folding: a 128 bit chunk hi:lo, n bits ahead of the data
+ * it's being folded into, is congruent to hi * x^(n + 64) + lo * x^n, and
+ * these constants are those powers of x mod the polynomial:
+ */
+static u64 crc64_fold_512[2], crc64_fold_128[2];
+
+static __attribute__((target("pclmul,ssse3")))
+__m128i crc64_fold(__m128i x, const u64 *k)
+{
+	__m128i kx = _mm_set_epi64x(k[1], k[0]);
+
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, kx, 0x11),
+			     _mm_clmulepi64_si128(x, kx, 0x00));
+}
+
+static __attribute__((target("pclmul,ssse3")))
+__m128i crc64_load(const u8 *p)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), bswap);
+}
+
+static __attribute__((target("pclmul,ssse3")))
+u64 crc64_pclmul(u64 crc, const void *buf, size_t size)
+{
+	const u8 *p = buf;
+	__m128i x0, x1, x2, x3;
+	u8 tail[16];
+
+	if (size < 64)
+		return crc64_default(crc, buf, size);
+
+	x0 = _mm_xor_si128(crc64_load(p), _mm_set_epi64x(crc, 0));
+	x1 = crc64_load(p + 16);
+	x2 = crc64_load(p + 32);
+	x3 = crc64_load(p + 48);
+	p	+= 64;
+	size	-= 64;
+
+	while (size >= 64) {
+		x0 = _mm_xor_si128(crc64_fold(x0, crc64_fold_512), crc64_load(p));
+		x1 = _mm_xor_si128(crc64_fold(x1, crc64_fold_512), crc64_load(p + 16));
+		x2 = _mm_xor_si128(crc64_fold(x2, crc64_fold_512), crc64_load(p + 32));
+		x3 = _mm_xor_si128(crc64_fold(x3, crc64_fold_512), crc64_load(p + 48));
+		p	+= 64;
+		size	-= 64;
+	}
+
+	x1 = _mm_xor_si128(crc64_fold(x0, crc64_fold_128), x1);
+	x2 = _mm_xor_si128(crc64_fold(x1, crc64_fold_128), x2);
+	x3 = _mm_xor_si128(crc64_fold(x2, crc64_fold_128), x3);
+
+	while (size >= 16) {
+		x3 = _mm_xor_si128(crc64_fold(x3, crc64_fold_128), crc64_load(p));
+		p	+= 16;
+		size	-= 16;
+	}
+
+	/* What's left is congruent to the data so far - finish with tables: */
+	_mm_storeu_si128((__m128i *) tail, crc64_load((const u8 *) &x3));
+
+	return crc64_default(crc64_default(0, tail, sizeof(tail)), p, size);
+}
+
+#endif /* __x86_64__ */
+
+/* a * b mod P: */
+static u64 crc64_mulmod(u64 a, u64 b)
+{
+	u64 r = 0, m;
+
+	for (m = 1ULL << 63; m; m >>= 1) {
+		r = (r << 1) ^ (r >> 63 ? CRC64_POLY : 0);
+		if (a & m)
+			r ^= b;
+	}
+
+	return r;
+}
+
+/* x^(2^i) mod P: */
+static u64 crc64_x2n[64];
+
+/* x^n mod P: */
+static u64 crc64_xpow(u64 n)
+{
+	u64 r = 1;		/* x^0 */
+	unsigned i;
+
+	for (i = 0; n; i++, n >>= 1)
+		if (n & 1)
+			r = crc64_mulmod(r, crc64_x2n[i]);
+
+	return r;
+}
+
+/* As __crc32c_le_shift(): the crc of the original data followed by @len zeroes */
+u64 crc64_be_shift(u64 crc, size_t len)
+{
+	return crc64_mulmod(crc, crc64_xpow((u64) len * 8));
+}
+
+__attribute__((constructor))
+static void crc64_init(void)
+{
+	unsigned i, j;
+
+	crc64_x2n[0] = 2;	/* x^1 */
+	for (i = 1; i < ARRAY_SIZE(crc64_x2n); i++)
+		crc64_x2n[i] = crc64_mulmod(crc64_x2n[i - 1], crc64_x2n[i - 1]);
+
+	for (i = 0; i < 256; i++) {
+		u64 crc = (u64) i << 56;
+
+		for (j = 0; j < 8; j++)
+			crc = (crc << 1) ^ (crc >> 63 ? CRC64_POLY : 0);
+		crc64_tab[0][i] = crc;
+	}
+
+	for (j = 1; j < 8; j++)
+		for (i = 0; i < 256; i++)
+			crc64_tab[j][i] = crc64_tab[0][crc64_tab[j - 1][i] >> 56] ^
+				(crc64_tab[j - 1][i] << 8);
+
+#ifdef __x86_64__
+	crc64_fold_512[1]	= crc64_xpow(512 + 64);
+	crc64_fold_512[0]	= crc64_xpow(512);
+	crc64_fold_128[1]	= crc64_xpow(128 + 64);
+	crc64_fold_128[0]	= crc64_xpow(128);
+#endif
+}
+
+static void *resolve_crc64(void)
+{
+	__builtin_cpu_init();
+
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("ssse3"))
+		return crc64_pclmul;
+#endif
+	return crc64_default;
+}
+
+#ifdef HAVE_WORKING_IFUNC
+
+u64 crc64_be(u64, const void *, size_t)
+	__attribute__((ifunc("resolve_crc64")));
+
+#else
+
+u64 crc64_be(u64 crc, const void *buf, size_t size)
+{
+	static u64 (*real_crc64)(u64, const void *, size_t);
+
+	if (unlikely(!real_crc64))
+		real_crc64 = resolve_crc64();
+
+	return real_crc64(crc, buf, size);
+}
+
+#endif /* HAVE_WORKING_IFUNC */
+
 char *dev_to_name(dev_t dev)
 {
 	char *line = NULL, *name = NULL;
@@ -633,4 +975,3 @@ found:
 	return ret;
 }
 
-#endif
@@ -149,6 +149,9 @@ const char *strcmp_prefix(const char *, const char *);
 unsigned hatoi_validate(const char *, const char *);
 
 u32 crc32c(u32, const void *, size_t);
+u32 __crc32c_le_shift(u32, size_t);
+u64 crc64_be(u64, const void *, size_t);
+u64 crc64_be_shift(u64, size_t);
 
 char *dev_to_name(dev_t);
 char *dev_to_path(dev_t);